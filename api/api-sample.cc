@@ -11,6 +11,12 @@ static void set_global()
     global = 1;
 }
 
+static kvm::run_loop::action guest_exit(uint16_t port, bool out, void *data,
+                                        unsigned size, unsigned count)
+{
+    return kvm::run_loop::stop;
+}
+
 int test_main(int ac, char** av)
 {
     kvm::system system;
@@ -19,7 +25,9 @@ int test_main(int ac, char** av)
     identity::vm ident_vm(vm, memmap);
     kvm::vcpu vcpu(vm, 0);
     identity::vcpu thread(vcpu, set_global);
-    vcpu.run();
+    kvm::run_loop loop(vcpu);
+    loop.add_pio(identity::exit_port, 1, guest_exit);
+    loop.run();
     printf("global %d\n", global);
     return global == 1 ? 0 : 1;
 }
@@ -0,0 +1,167 @@
+// Creates many child vms from one prepared template vm and reports how
+// long each takes to start and how many pages it ends up owning.
+
+#include "kvmxx.hh"
+#include "memmap.hh"
+#include "clone.hh"
+#include "exception.hh"
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace {
+
+uint64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Real-mode guest: increment one byte in each of nr_pages pages starting
+// at 64k, then halt.
+//   mov cx, nr_pages; mov ax, 0x1000
+//   1: mov es, ax; inc byte [es:0]; add ax, 0x100; dec cx; jnz 1b; hlt
+void load_guest(char* mem, uint16_t nr_pages)
+{
+    const unsigned char code[] = {
+        0xb9, uint8_t(nr_pages), uint8_t(nr_pages >> 8),
+        0xb8, 0x00, 0x10,
+        0x8e, 0xc0,
+        0x26, 0xfe, 0x06, 0x00, 0x00,
+        0x05, 0x00, 0x01,
+        0x49,
+        0x75, 0xf3,
+        0xf4,
+    };
+    memcpy(mem, code, sizeof(code));
+}
+
+void reset_vcpu(kvm::vcpu& vcpu)
+{
+    kvm_sregs sregs = vcpu.sregs();
+    sregs.cs.base = 0;
+    sregs.cs.selector = 0;
+    vcpu.set_sregs(sregs);
+    kvm_regs regs = {};
+    regs.rflags = 2;
+    vcpu.set_regs(regs);
+}
+
+int test_main(int ac, char** av)
+{
+    unsigned nr_clones = 100;
+    unsigned mem_mb = 64;
+    unsigned nr_pages = 64;
+    char default_path[64];
+    snprintf(default_path, sizeof(default_path),
+             "/dev/shm/kvm-clone-template.%d", int(getpid()));
+    std::string path = default_path;
+    int c;
+    while ((c = getopt(ac, av, "n:m:p:f:")) != -1) {
+        switch (c) {
+        case 'n':
+            nr_clones = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            mem_mb = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            nr_pages = strtoul(optarg, NULL, 0);
+            break;
+        case 'f':
+            path = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n clones] [-m template MiB]"
+                    " [-p pages each clone writes] [-f template file]\n",
+                    av[0]);
+            return 2;
+        }
+    }
+    // the guest addresses pages below 1M from 64k up
+    if (!nr_clones || mem_mb < 1 || !nr_pages || nr_pages > 240) {
+        fprintf(stderr, "need at least 1 MiB and 1 to 240 pages\n");
+        return 2;
+    }
+
+    kvm::system sys;
+    size_t mem_size = size_t(mem_mb) << 20;
+    char* mem = static_cast<char*>(::mmap(NULL, mem_size,
+                                          PROT_READ | PROT_WRITE,
+                                          MAP_PRIVATE | MAP_ANONYMOUS
+                                          | MAP_POPULATE, -1, 0));
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    memset(mem, 0x5a, mem_size);
+    load_guest(mem, nr_pages);
+
+    uint64_t t = now_ns();
+    std::auto_ptr<vm_template> tmpl;
+    {
+        kvm::vm vm(sys);
+        mem_map memmap(vm);
+        mem_slot slot(memmap, 0, mem_size, mem);
+        kvm::vcpu vcpu(vm, 0);
+        reset_vcpu(vcpu);
+        std::vector<kvm::vcpu*> vcpus(1, &vcpu);
+        tmpl.reset(new vm_template(memmap, vcpus, path));
+    }
+    printf("template: %u MiB saved in %.3f ms\n", mem_mb,
+           (now_ns() - t) / 1e6);
+    ::munmap(mem, mem_size);
+
+    typedef std::tr1::shared_ptr<vm_clone> clone_ptr;
+    std::vector<clone_ptr> clones;
+    std::vector<uint64_t> start_ns;
+    for (unsigned i = 0; i < nr_clones; ++i) {
+        t = now_ns();
+        clones.push_back(clone_ptr(new vm_clone(sys, *tmpl)));
+        start_ns.push_back(now_ns() - t);
+    }
+    uint64_t min_diverged = ~uint64_t(0), max_diverged = 0, total = 0;
+    for (unsigned i = 0; i < nr_clones; ++i) {
+        kvm::vcpu& vcpu = clones[i]->vcpu(0);
+        vcpu.run();
+        if (vcpu.shared()->exit_reason != KVM_EXIT_HLT) {
+            fprintf(stderr, "clone %u: unexpected exit %u\n", i,
+                    vcpu.shared()->exit_reason);
+            ::unlink(path.c_str());
+            return 1;
+        }
+        uint64_t n = clones[i]->diverged_pages();
+        min_diverged = std::min(min_diverged, n);
+        max_diverged = std::max(max_diverged, n);
+        total += n;
+    }
+    ::unlink(path.c_str());
+
+    std::sort(start_ns.begin(), start_ns.end());
+    printf("%u clones: start min %.3f p50 %.3f max %.3f ms\n", nr_clones,
+           start_ns.front() / 1e6, start_ns[start_ns.size() / 2] / 1e6,
+           start_ns.back() / 1e6);
+    printf("diverged pages per clone: min %llu max %llu total %llu"
+           " (%llu KiB of %llu MiB shared)\n",
+           (unsigned long long)min_diverged,
+           (unsigned long long)max_diverged,
+           (unsigned long long)total,
+           (unsigned long long)total * ::getpagesize() / 1024,
+           (unsigned long long)mem_mb);
+    return 0;
+}
+
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
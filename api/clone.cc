@@ -0,0 +1,30 @@
+
+#include "clone.hh"
+
+vm_template::vm_template(mem_map& map, const std::vector<kvm::vcpu*>& vcpus,
+                         const std::string& path)
+    : _path(path)
+{
+    snapshot snap(map, path);
+    for (unsigned i = 0; i < vcpus.size(); ++i) {
+        snap.add_vcpu(*vcpus[i]);
+    }
+    snap.save();
+}
+
+vm_clone::vm_clone(kvm::system& sys, const vm_template& tmpl)
+    : _vm(sys)
+    , _map(_vm)
+    , _image(tmpl.path())
+{
+    _image.restore_memory(_map);
+    for (unsigned i = 0; i < _image.nr_vcpus(); ++i) {
+        _vcpus.push_back(vcpu_ptr(new kvm::vcpu(_vm, i)));
+        _image.restore_vcpu(i, *_vcpus.back());
+    }
+}
+
+uint64_t vm_clone::diverged_pages() const
+{
+    return _image.private_pages();
+}
@@ -0,0 +1,42 @@
+#ifndef API_CLONE_HH
+#define API_CLONE_HH
+
+#include "kvmxx.hh"
+#include "memmap.hh"
+#include "snapshot.hh"
+#include <string>
+#include <vector>
+#include <tr1/memory>
+
+// The state of a prepared vm, saved once so that child vms can be created
+// from it cheaply.  Keep the file on tmpfs to share it from memory.
+class vm_template {
+public:
+    vm_template(mem_map& map, const std::vector<kvm::vcpu*>& vcpus,
+                const std::string& path);
+    const std::string& path() const { return _path; }
+private:
+    std::string _path;
+};
+
+// A child vm started from a template.  Its memory is the template's image
+// mapped MAP_PRIVATE, so all children share the template's pages until
+// they write to them.
+class vm_clone {
+public:
+    vm_clone(kvm::system& sys, const vm_template& tmpl);
+    kvm::vm& vm() { return _vm; }
+    mem_map& memmap() { return _map; }
+    unsigned nr_vcpus() const { return _vcpus.size(); }
+    kvm::vcpu& vcpu(unsigned i) { return *_vcpus[i]; }
+    // pages this clone has written, and so no longer shares
+    uint64_t diverged_pages() const;
+private:
+    typedef std::tr1::shared_ptr<kvm::vcpu> vcpu_ptr;
+    kvm::vm _vm;
+    mem_map _map;
+    snapshot_image _image;
+    std::vector<vcpu_ptr> _vcpus;
+};
+
+#endif
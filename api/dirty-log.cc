@@ -1,9 +1,17 @@
 #include "kvmxx.hh"
 #include "memmap.hh"
 #include "identity.hh"
+#include "executor.hh"
+#include "guestmem.hh"
 #include <boost/thread/thread.hpp>
 #include <stdlib.h>
 #include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <algorithm>
+#include <string>
+#include <vector>
 
 namespace {
 
@@ -14,33 +22,422 @@ void delay_loop(unsigned n)
     }
  }
 
-void write_mem(volatile bool& running, volatile int* shared_var)
+uint64_t rdtsc()
 {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return lo | (uint64_t(hi) << 32);
+}
+
+struct write_latency {
+    write_latency() : nr(), total(), max() {}
+    uint64_t nr;
+    uint64_t total;
+    uint64_t max;
+};
+
+// Besides the shared variable, each iteration dirties the next page of the
+// logged slot, so that re-protecting a large slot races with guest writes.
+void write_mem(volatile bool& running, volatile int* shared_var,
+               unsigned nr_pages, write_latency& lat)
+{
+    volatile char* mem = reinterpret_cast<volatile char*>(shared_var);
+    unsigned page = 0;
     while (running) {
+        uint64_t t = rdtsc();
         ++*shared_var;
+        ++mem[page * 4096 + 64];
+        t = rdtsc() - t;
+        lat.total += t;
+        lat.max = std::max(lat.max, t);
+        ++lat.nr;
+        if (++page == nr_pages) {
+            page = 0;
+        }
         delay_loop(1000);
     }
 }
 
+// Every page the guest wrote between two samples must be dirty in the log
+// harvested after the second; a pass also requires that the guest was
+// seen writing at all.
 void check_dirty_log(mem_slot& slot,
                      volatile bool& running,
-                     volatile int* shared_var,
+                     volatile unsigned& harvests,
+                     const guest_memory& mem,
+                     uint64_t shared_var_gpa,
+                     unsigned nr_pages,
                      int& nr_fail)
 {
-    uint64_t shared_var_gpa = reinterpret_cast<uint64_t>(shared_var);
+    std::vector<uint8_t> before(nr_pages);
+    std::vector<uint64_t> written;
+    uint64_t nr_written = 0;
     slot.set_dirty_logging(true);
     slot.update_dirty_log();
     for (int i = 0; i < 10000000; ++i) {
-        int sample1 = *shared_var;
+        int sample1 = mem.load<int>(shared_var_gpa, __ATOMIC_ACQUIRE);
+        for (unsigned page = 0; page < nr_pages; ++page) {
+            before[page] = mem.load<uint8_t>(shared_var_gpa + page * 4096 + 64,
+                                             __ATOMIC_ACQUIRE);
+        }
         delay_loop(600);
-        int sample2 = *shared_var;
+        int sample2 = mem.load<int>(shared_var_gpa, __ATOMIC_ACQUIRE);
+        written.clear();
+        for (unsigned page = 0; page < nr_pages; ++page) {
+            uint64_t gpa = shared_var_gpa + page * 4096;
+            if (mem.load<uint8_t>(gpa + 64, __ATOMIC_ACQUIRE) != before[page]) {
+                written.push_back(gpa);
+            }
+        }
         slot.update_dirty_log();
+        ++harvests;
         if (!slot.is_dirty(shared_var_gpa) && sample1 != sample2) {
             ++nr_fail;
         }
+        for (unsigned j = 0; j < written.size(); ++j) {
+            if (!slot.is_dirty(written[j])) {
+                ++nr_fail;
+            }
+        }
+        nr_written += written.size();
     }
     running = false;
     slot.set_dirty_logging(false);
+    if (!nr_written) {
+        fprintf(stderr, "the guest never wrote to the logged slot\n");
+        ++nr_fail;
+    }
+}
+
+// A full dirty ring stops the vcpu until the host harvests it; wait for
+// check_dirty_log() to do so and resume, rather than ending the run.
+bool resume_ring_full(volatile bool& running, volatile unsigned& harvests,
+                      kvm::vcpu& vcpu)
+{
+    if (vcpu.shared()->exit_reason != KVM_EXIT_DIRTY_RING_FULL) {
+        return false;
+    }
+    unsigned seen = harvests;
+    while (harvests == seen && running) {
+        delay_loop(100);
+    }
+    return running;
+}
+
+uint64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Benchmark mode: several guest writers dirty a large region with a given
+// pattern while the host harvests the log in rounds.  Writers are parked
+// before each harvest, and each write stamps the page with the current
+// round, so the log can be checked exactly against what was written.
+
+enum write_pattern { pattern_sequential, pattern_random, pattern_hotcold };
+
+struct bench_control {
+    volatile uint32_t round;
+    volatile bool pause;
+    volatile bool quit;
+    volatile unsigned nr_paused;
+    volatile unsigned nr_ring_full;
+    volatile unsigned harvests;
+};
+
+struct writer_params {
+    write_pattern pattern;
+    volatile char* base;
+    uint32_t nr_pages;
+    uint32_t first_page;
+    uint32_t seed;
+};
+
+uint32_t xorshift(uint32_t& x)
+{
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return x;
+}
+
+void park(bench_control& ctl)
+{
+    __sync_fetch_and_add(&ctl.nr_paused, 1);
+    while (ctl.pause && !ctl.quit) {
+        asm volatile("pause");
+    }
+    __sync_fetch_and_sub(&ctl.nr_paused, 1);
+}
+
+// 90% of the writes go to the first 10% of the region
+void bench_writer(bench_control& ctl,
+                  const std::vector<writer_params>& params, unsigned cpu)
+{
+    writer_params p = params[cpu];
+    uint32_t page = p.first_page;
+    uint32_t x = p.seed;
+    uint32_t nr_hot = std::max(p.nr_pages / 10, 1U);
+    while (!ctl.quit) {
+        if (ctl.pause) {
+            park(ctl);
+            continue;
+        }
+        switch (p.pattern) {
+        case pattern_sequential:
+            if (++page == p.nr_pages) {
+                page = 0;
+            }
+            break;
+        case pattern_random:
+            page = xorshift(x) % p.nr_pages;
+            break;
+        case pattern_hotcold:
+            if (xorshift(x) % 10) {
+                page = xorshift(x) % nr_hot;
+            } else {
+                page = xorshift(x) % p.nr_pages;
+            }
+            break;
+        }
+        *reinterpret_cast<volatile uint32_t*>(p.base + page * 4096UL)
+            = ctl.round;
+    }
+}
+
+// A full dirty ring stops the vcpu until the host harvests.  That is not
+// a safe point to harvest a round at, since the write that filled the ring
+// has not retired, so it is counted apart from the parked writers.
+void run_writer(bench_control& ctl, kvm::vcpu& vcpu)
+{
+    for (;;) {
+        vcpu.run();
+        if (vcpu.shared()->exit_reason != KVM_EXIT_DIRTY_RING_FULL) {
+            break;
+        }
+        unsigned harvests = ctl.harvests;
+        __sync_fetch_and_add(&ctl.nr_ring_full, 1);
+        while (ctl.harvests == harvests && !ctl.quit) {
+            delay_loop(100);
+        }
+        __sync_fetch_and_sub(&ctl.nr_ring_full, 1);
+    }
+}
+
+struct bench_options {
+    bench_options()
+        : region_mb(1024), nr_vcpus(2), pattern(pattern_random)
+        , nr_rounds(10), interval_ms(100), ring_size(0), clear_chunk(0) {}
+    unsigned region_mb;
+    unsigned nr_vcpus;
+    write_pattern pattern;
+    std::vector<unsigned> slot_mb;
+    unsigned nr_rounds;
+    unsigned interval_ms;
+    uint32_t ring_size;
+    uint64_t clear_chunk;
+};
+
+struct round_result {
+    round_result() : harvest_ns(), dirty(), written(), missed(), spurious() {}
+    uint64_t harvest_ns;
+    uint64_t dirty;
+    uint64_t written;
+    uint64_t missed;
+    uint64_t spurious;
+};
+
+typedef std::tr1::shared_ptr<mem_slot> mem_slot_ptr;
+
+// guest memory is identity mapped, so a dirty gpa is also the host address
+void count_spurious(uint32_t round, uint64_t& spurious, uint64_t gpa)
+{
+    if (*reinterpret_cast<const uint32_t*>(static_cast<unsigned long>(gpa))
+        != round) {
+        ++spurious;
+    }
+}
+
+// Writers stopped on a full ring can only park once the rings have room,
+// so collect the rings meanwhile.  The pages stay queued on their slots
+// for the round's update_dirty_log().
+void pause_writers(bench_control& ctl, mem_map& memmap, unsigned nr_vcpus)
+{
+    ctl.pause = true;
+    while (ctl.nr_paused != nr_vcpus) {
+        if (ctl.nr_ring_full) {
+            memmap.harvest_dirty_rings();
+            ++ctl.harvests;
+        }
+        delay_loop(100);
+    }
+}
+
+void resume_writers(bench_control& ctl)
+{
+    ctl.pause = false;
+    while (ctl.nr_paused) {
+        delay_loop(100);
+    }
+}
+
+round_result bench_round(bench_control& ctl, const bench_options& opt,
+                         mem_map& memmap, std::vector<mem_slot_ptr>& slots,
+                         const char* base, uint64_t slot_size)
+{
+    round_result r;
+    ++ctl.round;
+    resume_writers(ctl);
+    usleep(opt.interval_ms * 1000);
+    pause_writers(ctl, memmap, opt.nr_vcpus);
+
+    uint64_t t = now_ns();
+    for (unsigned i = 0; i < slots.size(); ++i) {
+        slots[i]->update_dirty_log();
+        r.dirty += slots[i]->dirty_count();
+    }
+    r.harvest_ns = now_ns() - t;
+    ++ctl.harvests;
+
+    using namespace std::tr1::placeholders;
+    for (unsigned i = 0; i < slots.size(); ++i) {
+        slots[i]->for_each_dirty(std::tr1::bind(count_spurious, ctl.round,
+                                                std::tr1::ref(r.spurious),
+                                                _1));
+    }
+    uint64_t nr_pages = uint64_t(opt.region_mb) << 8;
+    uint64_t base_gpa = reinterpret_cast<unsigned long>(base);
+    for (uint64_t page = 0; page < nr_pages; ++page) {
+        if (*reinterpret_cast<const uint32_t*>(base + page * 4096)
+            != ctl.round) {
+            continue;
+        }
+        ++r.written;
+        uint64_t offset = page * 4096;
+        if (!slots[offset / slot_size]->is_dirty(base_gpa + offset)) {
+            ++r.missed;
+        }
+    }
+    return r;
+}
+
+void bench_slot_size(bench_control& ctl, const bench_options& opt,
+                     mem_map& memmap, char* base, uint64_t slot_size)
+{
+    uint64_t region_size = uint64_t(opt.region_mb) << 20;
+    uint64_t base_gpa = reinterpret_cast<unsigned long>(base);
+    std::vector<mem_slot_ptr> slots;
+    for (uint64_t off = 0; off < region_size; off += slot_size) {
+        uint64_t size = std::min(slot_size, region_size - off);
+        slots.push_back(mem_slot_ptr(new mem_slot(memmap, base_gpa + off,
+                                                  size, base + off)));
+        slots.back()->set_clear_chunk(opt.clear_chunk);
+        slots.back()->set_dirty_logging(true);
+    }
+    for (unsigned i = 0; i < slots.size(); ++i) {
+        slots[i]->update_dirty_log();
+    }
+    ++ctl.harvests;
+
+    round_result total;
+    uint64_t max_harvest_ns = 0;
+    for (unsigned i = 0; i < opt.nr_rounds; ++i) {
+        round_result r = bench_round(ctl, opt, memmap, slots, base,
+                                     slot_size);
+        total.harvest_ns += r.harvest_ns;
+        total.dirty += r.dirty;
+        total.written += r.written;
+        total.missed += r.missed;
+        total.spurious += r.spurious;
+        max_harvest_ns = std::max(max_harvest_ns, r.harvest_ns);
+    }
+    printf("%8llu %6u %12llu %12llu %14.0f %10llu %10.6f %10.6f\n",
+           (unsigned long long)(slot_size >> 20), unsigned(slots.size()),
+           (unsigned long long)(total.harvest_ns / opt.nr_rounds / 1000),
+           (unsigned long long)(max_harvest_ns / 1000),
+           total.harvest_ns ? total.dirty * 1e9 / total.harvest_ns : 0.0,
+           (unsigned long long)(total.dirty / opt.nr_rounds),
+           total.written ? double(total.missed) / total.written : 0.0,
+           total.dirty ? double(total.spurious) / total.dirty : 0.0);
+}
+
+int bench_main(const bench_options& opt)
+{
+    kvm::system sys;
+    kvm::vm vm(sys);
+    if (opt.ring_size) {
+        vm.enable_dirty_ring(opt.ring_size);
+    } else if (opt.clear_chunk) {
+        vm.enable_manual_dirty_log_protect();
+    }
+    mem_map memmap(vm);
+    uint64_t region_size = uint64_t(opt.region_mb) << 20;
+    void* region = NULL;
+    if (posix_memalign(&region, 2 << 20, region_size)) {
+        fprintf(stderr, "cannot allocate %u MiB\n", opt.region_mb);
+        return 1;
+    }
+    char* base = static_cast<char*>(region);
+    memset(base, 0, region_size);
+    identity::hole hole(region, region_size);
+    identity::vm ident_vm(vm, memmap, hole);
+
+    bench_control ctl = {};
+    ctl.pause = true;
+    std::vector<writer_params> params;
+    for (unsigned i = 0; i < opt.nr_vcpus; ++i) {
+        writer_params p;
+        p.pattern = opt.pattern;
+        p.base = base;
+        p.nr_pages = region_size >> 12;
+        p.first_page = p.nr_pages / opt.nr_vcpus * i;
+        p.seed = 2463534242U + i * 7919;
+        params.push_back(p);
+    }
+    using namespace std::tr1::placeholders;
+    identity::vcpu_set writers(vm, opt.nr_vcpus,
+                               std::tr1::bind(bench_writer,
+                                              std::tr1::ref(ctl),
+                                              std::tr1::cref(params), _1));
+    for (unsigned i = 0; i < writers.size(); ++i) {
+        memmap.add_vcpu(writers[i]);
+    }
+    writers.start(std::tr1::bind(run_writer, std::tr1::ref(ctl), _1));
+    pause_writers(ctl, memmap, opt.nr_vcpus);
+
+    printf("%8s %6s %12s %12s %14s %10s %10s %10s\n",
+           "slot_MiB", "slots", "harvest_us", "max_us", "pages/s",
+           "dirty", "missed", "spurious");
+    for (unsigned i = 0; i < opt.slot_mb.size(); ++i) {
+        uint64_t slot_size = uint64_t(opt.slot_mb[i]) << 20;
+        bench_slot_size(ctl, opt, memmap, base, slot_size);
+    }
+    ctl.quit = true;
+    writers.join();
+    return 0;
+}
+
+bool parse_pattern(const char* s, write_pattern& pattern)
+{
+    if (!strcmp(s, "seq")) {
+        pattern = pattern_sequential;
+    } else if (!strcmp(s, "random")) {
+        pattern = pattern_random;
+    } else if (!strcmp(s, "hotcold")) {
+        pattern = pattern_hotcold;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+void parse_slot_sizes(char* s, std::vector<unsigned>& sizes)
+{
+    for (char* tok = strtok(s, ","); tok; tok = strtok(NULL, ",")) {
+        sizes.push_back(strtoul(tok, NULL, 0));
+    }
 }
 
 }
@@ -50,29 +447,135 @@ using std::tr1::bind;
 
 int main(int ac, char **av)
 {
+    uint32_t ring_size = 0;
+    unsigned nr_pages = 1;
+    uint64_t clear_chunk = 0;
+    int vcpu_cpu = -1;
+    bool bench = false;
+    bench_options bopt;
+    int opt;
+    while ((opt = getopt(ac, av, "r:p:c:C:bm:v:w:s:n:i:")) != -1) {
+        switch (opt) {
+        case 'r':
+            ring_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            nr_pages = strtoul(optarg, NULL, 0);
+            break;
+        case 'c':
+            clear_chunk = strtoull(optarg, NULL, 0);
+            break;
+        case 'C':
+            vcpu_cpu = atoi(optarg);
+            break;
+        case 'b':
+            bench = true;
+            break;
+        case 'm':
+            bopt.region_mb = strtoul(optarg, NULL, 0);
+            break;
+        case 'v':
+            bopt.nr_vcpus = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            if (!parse_pattern(optarg, bopt.pattern)) {
+                fprintf(stderr, "unknown write pattern %s\n", optarg);
+                return 2;
+            }
+            break;
+        case 's':
+            parse_slot_sizes(optarg, bopt.slot_mb);
+            break;
+        case 'n':
+            bopt.nr_rounds = strtoul(optarg, NULL, 0);
+            break;
+        case 'i':
+            bopt.interval_ms = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-r dirty ring bytes] [-p pages]"
+                    " [-c clear chunk pages] [-C vcpu host cpu]\n"
+                    "       %s -b [-m region MiB] [-v writers]"
+                    " [-w seq|random|hotcold]\n"
+                    "          [-s slot MiB,...] [-n rounds]"
+                    " [-i interval ms] [-r ring bytes] [-c chunk]\n",
+                    av[0], av[0]);
+            return 2;
+        }
+    }
+    if (!nr_pages || clear_chunk % 64) {
+        fprintf(stderr, "need at least one page, and a clear chunk"
+                " that is a multiple of 64 pages\n");
+        return 2;
+    }
+    if (bench) {
+        bopt.ring_size = ring_size;
+        bopt.clear_chunk = clear_chunk;
+        if (bopt.slot_mb.empty()) {
+            unsigned defaults[] = { 2, 32, 256, bopt.region_mb };
+            bopt.slot_mb.assign(defaults, defaults + 4);
+        }
+        for (unsigned i = 0; i < bopt.slot_mb.size(); ++i) {
+            if (!bopt.slot_mb[i] || bopt.slot_mb[i] > bopt.region_mb) {
+                bopt.slot_mb[i] = bopt.region_mb;
+            }
+        }
+        if (!bopt.region_mb || !bopt.nr_vcpus || !bopt.nr_rounds) {
+            fprintf(stderr, "region, writers and rounds must be nonzero\n");
+            return 2;
+        }
+        return bench_main(bopt);
+    }
     kvm::system sys;
     kvm::vm vm(sys);
+    if (ring_size) {
+        vm.enable_dirty_ring(ring_size);
+    } else if (clear_chunk) {
+        vm.enable_manual_dirty_log_protect();
+    }
     mem_map memmap(vm);
-    void* logged_slot_virt;
-    posix_memalign(&logged_slot_virt, 4096, 4096);
+    size_t logged_size = size_t(nr_pages) * 4096;
+    void* logged_slot_virt = NULL;
+    posix_memalign(&logged_slot_virt, 4096, logged_size);
     int* shared_var = static_cast<int*>(logged_slot_virt);
-    identity::hole hole(logged_slot_virt, 4096);
+    identity::hole hole(logged_slot_virt, logged_size);
     identity::vm ident_vm(vm, memmap, hole);
     kvm::vcpu vcpu(vm, 0);
+    memmap.add_vcpu(vcpu);
     bool running = true;
+    unsigned harvests = 0;
     int nr_fail = 0;
+    write_latency lat;
     mem_slot logged_slot(memmap,
                          reinterpret_cast<uint64_t>(logged_slot_virt),
-                         4096, logged_slot_virt);
-    boost::thread host_poll_thread(check_dirty_log, ref(logged_slot),
-                                   ref(running),
-                                   ref(shared_var), ref(nr_fail));
-    identity::vcpu guest_write_thread(vcpu,
-                                      bind(write_mem,
-                                           ref(running),
-                                           ref(shared_var)));
-    vcpu.run();
-    host_poll_thread.join();
+                         logged_size, logged_slot_virt);
+    logged_slot.set_clear_chunk(clear_chunk);
+    vcpu_executor executor;
+    executor.add(vcpu, std::tr1::bind(resume_ring_full,
+                                      std::tr1::ref(running),
+                                      std::tr1::ref(harvests),
+                                      std::tr1::placeholders::_1),
+                 vcpu_cpu,
+                 identity::enter(bind(write_mem, ref(running),
+                                      ref(shared_var), nr_pages, ref(lat))));
+    executor.place_memory(0, logged_slot_virt, logged_size);
+    executor.start();
+    guest_memory mem(memmap);
+    check_dirty_log(logged_slot, running, harvests, mem, logged_slot.gpa(),
+                    nr_pages, nr_fail);
+    executor.join();
+    vcpu_executor::vcpu_stats st = executor.stats(0);
+    printf("vcpu: %llu exits, %llu ms in guest, %llu ms in userspace\n",
+           (unsigned long long)st.exits,
+           (unsigned long long)(st.guest_ns / 1000000),
+           (unsigned long long)(st.user_ns / 1000000));
     printf("Dirty bitmap failures: %d\n", nr_fail);
+    if (lat.nr) {
+        printf("Guest write latency: avg %llu max %llu cycles"
+               " (%u pages, clear chunk %llu)\n",
+               (unsigned long long)(lat.total / lat.nr),
+               (unsigned long long)lat.max, nr_pages,
+               (unsigned long long)clear_chunk);
+    }
     return nr_fail == 0 ? 0 : 1;
 }
@@ -0,0 +1,166 @@
+// Compares exit rates for a doorbell-style write loop when the doorbell
+// exits to userspace, is a coalesced MMIO zone, or is an ioeventfd.
+
+#include "kvmxx.hh"
+#include "memmap.hh"
+#include "identity.hh"
+#include "exception.hh"
+#include <boost/thread/thread.hpp>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+
+// above the 3GB the identity vm maps, and clear of its TSS
+const uint32_t doorbell = 0xe0000000;
+
+uint64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+enum doorbell_mode { mode_exit, mode_coalesced, mode_ioeventfd };
+
+const char* mode_names[] = { "exit", "coalesced", "ioeventfd" };
+
+struct result {
+    result() : writes(), exits(), ns() {}
+    uint64_t writes;
+    uint64_t exits;
+    uint64_t ns;
+};
+
+// runs in the guest
+void ring_doorbell(unsigned nr_writes, unsigned cpu)
+{
+    volatile uint32_t* db = reinterpret_cast<volatile uint32_t*>(
+        static_cast<unsigned long>(doorbell));
+    for (unsigned i = 0; i < nr_writes; ++i) {
+        *db = i;
+    }
+}
+
+kvm::run_loop::action count_write(uint64_t& writes, uint64_t gpa,
+                                  bool write, void *data, unsigned len)
+{
+    ++writes;
+    return kvm::run_loop::resume;
+}
+
+kvm::run_loop::action guest_exit(uint16_t port, bool out, void *data,
+                                 unsigned size, unsigned count)
+{
+    return kvm::run_loop::stop;
+}
+
+void run_vcpu(result& r, kvm::vcpu& vcpu)
+{
+    using namespace std::tr1::placeholders;
+    kvm::run_loop loop(vcpu);
+    loop.add_mmio(doorbell, 4, std::tr1::bind(count_write,
+                                              std::tr1::ref(r.writes),
+                                              _1, _2, _3, _4));
+    loop.add_pio(identity::exit_port, 1, guest_exit);
+    uint64_t t = now_ns();
+    loop.run();
+    r.ns = now_ns() - t;
+    r.exits = loop.nr_exits();
+}
+
+void drain_eventfd(kvm::eventfd& efd, volatile bool& done, uint64_t& writes)
+{
+    while (!done) {
+        writes += efd.read();
+    }
+}
+
+result run_mode(doorbell_mode mode, unsigned nr_writes)
+{
+    using namespace std::tr1::placeholders;
+    kvm::system sys;
+    kvm::vm vm(sys);
+    mem_map memmap(vm);
+    identity::vm ident_vm(vm, memmap);
+    kvm::eventfd efd;
+    volatile bool done = false;
+    uint64_t signalled = 0;
+    boost::thread consumer;
+    switch (mode) {
+    case mode_exit:
+        break;
+    case mode_coalesced:
+        vm.add_coalesced_mmio(doorbell, 4);
+        break;
+    case mode_ioeventfd:
+        vm.add_ioeventfd(efd.get(), doorbell, 4);
+        consumer = boost::thread(std::tr1::bind(drain_eventfd,
+                                                std::tr1::ref(efd),
+                                                std::tr1::ref(done),
+                                                std::tr1::ref(signalled)));
+        break;
+    }
+    result r;
+    identity::vcpu_set vcpus(vm, 1, std::tr1::bind(ring_doorbell,
+                                                   nr_writes, _1));
+    vcpus.start(std::tr1::bind(run_vcpu, std::tr1::ref(r), _1));
+    vcpus.join();
+    if (mode == mode_ioeventfd) {
+        // Wake the consumer one last time.  It may exit without reading
+        // that count, or the last writes, so drain what is left without
+        // blocking; the extra count is not a write.
+        done = true;
+        efd.write();
+        consumer.join();
+        if (fcntl(efd.get(), F_SETFL, O_NONBLOCK) == -1) {
+            throw errno_exception(errno);
+        }
+        signalled += efd.read();
+        r.writes += signalled - 1;
+    }
+    return r;
+}
+
+int test_main(int ac, char** av)
+{
+    unsigned nr_writes = 1000000;
+    int c;
+    while ((c = getopt(ac, av, "n:")) != -1) {
+        switch (c) {
+        case 'n':
+            nr_writes = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n doorbell writes]\n", av[0]);
+            return 2;
+        }
+    }
+    printf("%-10s %10s %10s %12s %14s %14s\n", "mode", "writes", "exits",
+           "exits/write", "writes/s", "exits/s");
+    int ret = 0;
+    for (int mode = mode_exit; mode <= mode_ioeventfd; ++mode) {
+        result r = run_mode(doorbell_mode(mode), nr_writes);
+        printf("%-10s %10llu %10llu %12.4f %14.0f %14.0f\n",
+               mode_names[mode], (unsigned long long)r.writes,
+               (unsigned long long)r.exits, double(r.exits) / nr_writes,
+               nr_writes * 1e9 / r.ns, r.exits * 1e9 / r.ns);
+        if (r.writes != nr_writes) {
+            fprintf(stderr, "%s: saw %llu of %u writes\n", mode_names[mode],
+                    (unsigned long long)r.writes, nr_writes);
+            ret = 1;
+        }
+    }
+    return ret;
+}
+
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
@@ -0,0 +1,213 @@
+
+#include "executor.hh"
+#include "exception.hh"
+#include <sched.h>
+#include <stdio.h>
+#include <dirent.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+
+// from <numaif.h>, which needs libnuma to link
+const int mpol_bind = 2;
+const unsigned mpol_mf_move = 1 << 1;
+
+uint64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// the nodeN link in the cpu's sysfs directory; -1 without NUMA
+int cpu_node(int cpu)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+    DIR* dir = opendir(path);
+    if (!dir) {
+        return -1;
+    }
+    int node = -1;
+    while (dirent* d = readdir(dir)) {
+        if (!strncmp(d->d_name, "node", 4)) {
+            node = atoi(d->d_name + 4);
+            break;
+        }
+    }
+    closedir(dir);
+    return node;
+}
+
+void pin(int cpu)
+{
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+    if (sched_setaffinity(0, sizeof(mask), &mask) == -1) {
+        throw errno_exception(errno);
+    }
+}
+
+}
+
+vcpu_executor::vcpu_executor()
+    : _stop(false), _started(false), _joined(false)
+{
+}
+
+vcpu_executor::~vcpu_executor()
+{
+    if (_joined) {
+        return;
+    }
+    try {
+        stop();
+        _threads.join_all();
+    } catch (...) {
+    }
+}
+
+unsigned vcpu_executor::add(kvm::vcpu& vcpu, exit_func on_exit,
+                            int host_cpu, enter_func enter)
+{
+    if (_started) {
+        throw errno_exception(EBUSY);
+    }
+    vcpu_entry e;
+    e.vcpu = &vcpu;
+    e.on_exit = on_exit;
+    e.enter = enter;
+    e.cpu = host_cpu;
+    e.node = host_cpu < 0 ? -1 : cpu_node(host_cpu);
+    e.entered = false;
+    e.running = false;
+    _vcpus.push_back(e);
+    return _vcpus.size() - 1;
+}
+
+void vcpu_executor::place_memory(unsigned index, void* addr, size_t size)
+{
+    int node = _vcpus[index].node;
+    if (node < 0) {
+        return;
+    }
+    const unsigned bits = sizeof(unsigned long) * 8;
+    std::vector<unsigned long> mask(node / bits + 1);
+    mask[node / bits] = 1UL << (node % bits);
+    if (syscall(__NR_mbind, addr, size, mpol_bind, &mask[0],
+                mask.size() * bits, mpol_mf_move) == -1) {
+        throw errno_exception(errno);
+    }
+}
+
+void vcpu_executor::start()
+{
+    _started = true;
+    _barrier.reset(new boost::barrier(_vcpus.size() + 1));
+    for (unsigned i = 0; i < _vcpus.size(); ++i) {
+        _threads.create_thread(std::tr1::bind(&vcpu_executor::thread_main,
+                                              this, i));
+    }
+    _barrier->wait();
+}
+
+// A vcpu that has not entered its loop yet sees _stop before its first
+// KVM_RUN.  One that has left it may have exited its thread, so only
+// vcpus still in the loop are kicked; the lock keeps them there meanwhile.
+void vcpu_executor::stop()
+{
+    __atomic_store_n(&_stop, true, __ATOMIC_SEQ_CST);
+    boost::mutex::scoped_lock lock(_running_lock);
+    for (unsigned i = 0; i < _vcpus.size(); ++i) {
+        if (_vcpus[i].running) {
+            _vcpus[i].vcpu->kick();
+        }
+    }
+}
+
+void vcpu_executor::join()
+{
+    _threads.join_all();
+    _joined = true;
+    for (unsigned i = 0; i < _vcpus.size(); ++i) {
+        if (_vcpus[i].error) {
+            throw *_vcpus[i].error;
+        }
+    }
+}
+
+// A thread that fails before reaching run() still meets the barrier, so
+// that start() returns.
+void vcpu_executor::thread_main(unsigned index)
+{
+    vcpu_entry& e = _vcpus[index];
+    try {
+        if (e.cpu >= 0) {
+            pin(e.cpu);
+        }
+        if (e.enter) {
+            e.enter(*e.vcpu, std::tr1::bind(&vcpu_executor::run, this,
+                                             index));
+        } else {
+            run(index);
+        }
+    } catch (errno_exception& ex) {
+        e.error.reset(new errno_exception(ex));
+    } catch (...) {
+        e.error.reset(new errno_exception(EIO));
+    }
+    if (!e.entered) {
+        e.entered = true;
+        _barrier->wait();
+    }
+}
+
+void vcpu_executor::run(unsigned index)
+{
+    vcpu_entry& e = _vcpus[index];
+    e.entered = true;
+    set_running(e, true);
+    _barrier->wait();
+    try {
+        run_loop(e);
+    } catch (...) {
+        set_running(e, false);
+        throw;
+    }
+    set_running(e, false);
+}
+
+void vcpu_executor::set_running(vcpu_entry& e, bool running)
+{
+    boost::mutex::scoped_lock lock(_running_lock);
+    e.running = running;
+}
+
+void vcpu_executor::run_loop(vcpu_entry& e)
+{
+    uint64_t t = now_ns();
+    while (!__atomic_load_n(&_stop, __ATOMIC_SEQ_CST)) {
+        uint64_t entry = now_ns();
+        e.stats.user_ns += entry - t;
+        kvm::result<void> r = e.vcpu->try_run();
+        t = now_ns();
+        e.stats.guest_ns += t - entry;
+        if (!r.ok()) {
+            // a kick from stop(), or a stray signal to resume after
+            if (r.error() != EINTR) {
+                throw errno_exception(r.error());
+            }
+            continue;
+        }
+        ++e.stats.exits;
+        if (!e.on_exit || !e.on_exit(*e.vcpu)) {
+            break;
+        }
+    }
+    e.stats.user_ns += now_ns() - t;
+}
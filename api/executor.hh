@@ -0,0 +1,82 @@
+#ifndef API_EXECUTOR_HH
+#define API_EXECUTOR_HH
+
+#include "kvmxx.hh"
+#include "exception.hh"
+#include <stddef.h>
+#include <memory>
+#include <vector>
+#include <tr1/functional>
+#include <tr1/memory>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/barrier.hpp>
+#include <boost/thread/mutex.hpp>
+
+// Runs each vcpu on its own host thread, optionally pinned to a host cpu,
+// counting exits and the time spent in KVM_RUN ("guest") and between
+// runs ("user").  start() returns once every thread is about to enter the
+// guest; stop() kicks every vcpu out of the guest, so it also stops vcpus
+// that never exit on their own.
+class vcpu_executor {
+public:
+    typedef std::tr1::function<void ()> run_func;
+    // called on the vcpu's thread to set the vcpu up; it must call run,
+    // which returns when the vcpu stops
+    typedef std::tr1::function<void (kvm::vcpu& vcpu, run_func run)>
+        enter_func;
+    // called after each exit; returns false to stop the vcpu.  Without
+    // one, the vcpu stops at its first exit.
+    typedef std::tr1::function<bool (kvm::vcpu& vcpu)> exit_func;
+    struct vcpu_stats {
+        vcpu_stats() : exits(), guest_ns(), user_ns() {}
+        uint64_t exits;
+        uint64_t guest_ns;
+        uint64_t user_ns;
+    };
+public:
+    vcpu_executor();
+    ~vcpu_executor();
+    // host_cpu < 0 leaves the vcpu unpinned; returns the vcpu's index
+    unsigned add(kvm::vcpu& vcpu, exit_func on_exit = exit_func(),
+                 int host_cpu = -1, enter_func enter = enter_func());
+    unsigned size() const { return _vcpus.size(); }
+    // the NUMA node of the vcpu's host cpu, or -1 if it is not pinned
+    int node(unsigned index) const { return _vcpus[index].node; }
+    // binds memory (page aligned) to the vcpu's node, so that guest memory
+    // it touches first is allocated there; no-op for an unpinned vcpu
+    void place_memory(unsigned index, void* addr, size_t size);
+    void start();
+    void stop();
+    // rethrows the first error a vcpu thread failed with; exceptions other
+    // than errno_exception are reported as EIO
+    void join();
+    // exact once joined
+    vcpu_stats stats(unsigned index) const { return _vcpus[index].stats; }
+private:
+    struct vcpu_entry {
+        kvm::vcpu* vcpu;
+        exit_func on_exit;
+        enter_func enter;
+        int cpu;
+        int node;
+        bool entered;
+        // in run()'s loop, so its thread is alive to be kicked
+        bool running;
+        std::tr1::shared_ptr<errno_exception> error;
+        vcpu_stats stats;
+    };
+    void thread_main(unsigned index);
+    void run(unsigned index);
+    void run_loop(vcpu_entry& e);
+    void set_running(vcpu_entry& e, bool running);
+private:
+    std::vector<vcpu_entry> _vcpus;
+    volatile bool _stop;
+    bool _started;
+    bool _joined;
+    boost::mutex _running_lock;
+    std::auto_ptr<boost::barrier> _barrier;
+    boost::thread_group _threads;
+};
+
+#endif
@@ -0,0 +1,377 @@
+// Measures the full KVM_RUN -> userspace -> KVM_RUN round trip for port
+// I/O, MMIO and HLT exits, as seen from inside an identity guest.
+
+#include "kvmxx.hh"
+#include "memmap.hh"
+#include "identity.hh"
+#include "kvmstats.hh"
+#include "exception.hh"
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <sched.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+namespace {
+
+const uint16_t bench_port = 0x80;
+// above the 3GB the identity vm maps, and clear of its TSS
+const uint32_t bench_mmio = 0xe0000000;
+
+uint64_t rdtsc()
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return lo | (uint64_t(hi) << 32);
+}
+
+uint64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+double tsc_per_ns()
+{
+    uint64_t t0 = now_ns(), c0 = rdtsc();
+    usleep(100000);
+    uint64_t t1 = now_ns(), c1 = rdtsc();
+    return double(c1 - c0) / (t1 - t0);
+}
+
+enum handling { handle_inline, handle_poll, handle_block };
+
+// Stands in for a device model running on its own thread; the exit
+// handler hands each access over and waits for it to complete, either
+// spinning or sleeping on a condition variable.
+class device {
+public:
+    explicit device(handling mode, int cpu);
+    ~device();
+    void access(uint32_t value);
+private:
+    void thread_main(int cpu);
+    void emulate() { _state = _state * 31 + _value; }
+private:
+    handling _mode;
+    volatile bool _quit;
+    volatile unsigned _requests;
+    volatile unsigned _completions;
+    uint32_t _value;
+    uint32_t _state;
+    boost::mutex _mutex;
+    boost::condition_variable _cond;
+    boost::thread _thread;
+};
+
+bool pin(int cpu)
+{
+    if (cpu < 0) {
+        return true;
+    }
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+    if (sched_setaffinity(0, sizeof(mask), &mask) == -1) {
+        perror("sched_setaffinity");
+        return false;
+    }
+    return true;
+}
+
+device::device(handling mode, int cpu)
+    : _mode(mode), _quit(false), _requests(0), _completions(0)
+    , _value(0), _state(0)
+{
+    if (_mode != handle_inline) {
+        _thread = boost::thread(std::tr1::bind(&device::thread_main, this,
+                                               cpu));
+    }
+}
+
+device::~device()
+{
+    {
+        boost::mutex::scoped_lock lock(_mutex);
+        _quit = true;
+        _cond.notify_all();
+    }
+    if (_thread.joinable()) {
+        _thread.join();
+    }
+}
+
+void device::access(uint32_t value)
+{
+    _value = value;
+    switch (_mode) {
+    case handle_inline:
+        emulate();
+        break;
+    case handle_poll:
+        __sync_synchronize();
+        ++_requests;
+        while (_completions != _requests) {
+            asm volatile("pause");
+        }
+        break;
+    case handle_block: {
+        boost::mutex::scoped_lock lock(_mutex);
+        ++_requests;
+        _cond.notify_all();
+        while (_completions != _requests) {
+            _cond.wait(lock);
+        }
+        break;
+    }
+    }
+}
+
+void device::thread_main(int cpu)
+{
+    pin(cpu);
+    if (_mode == handle_poll) {
+        while (!_quit) {
+            if (_requests != _completions) {
+                emulate();
+                __sync_synchronize();
+                _completions = _requests;
+            }
+        }
+        return;
+    }
+    boost::mutex::scoped_lock lock(_mutex);
+    while (!_quit) {
+        if (_requests == _completions) {
+            _cond.wait(lock);
+            continue;
+        }
+        emulate();
+        _completions = _requests;
+        _cond.notify_all();
+    }
+}
+
+struct samples {
+    explicit samples(unsigned n) : pio(n), mmio(n), hlt(n) {}
+    std::vector<uint64_t> pio;
+    std::vector<uint64_t> mmio;
+    std::vector<uint64_t> hlt;
+};
+
+struct bench_options {
+    bench_options()
+        : nr_samples(100000), nr_warmup(1000), mode(handle_inline)
+        , vcpu_cpu(-1), device_cpu(-1), kvm_stats(false) {}
+    unsigned nr_samples;
+    unsigned nr_warmup;
+    handling mode;
+    int vcpu_cpu;
+    int device_cpu;
+    bool kvm_stats;
+};
+
+// runs in the guest
+void guest_main(const bench_options& opt, samples& s, unsigned cpu)
+{
+    volatile uint32_t* mmio = reinterpret_cast<volatile uint32_t*>(
+        static_cast<unsigned long>(bench_mmio));
+    for (unsigned i = 0; i < opt.nr_warmup + opt.nr_samples; ++i) {
+        uint64_t t0 = rdtsc();
+        asm volatile("outl %0, %1" : : "a"(i), "Nd"(bench_port));
+        uint64_t t1 = rdtsc();
+        *mmio = i;
+        uint64_t t2 = rdtsc();
+        asm volatile("hlt");
+        uint64_t t3 = rdtsc();
+        if (i >= opt.nr_warmup) {
+            s.pio[i - opt.nr_warmup] = t1 - t0;
+            s.mmio[i - opt.nr_warmup] = t2 - t1;
+            s.hlt[i - opt.nr_warmup] = t3 - t2;
+        }
+    }
+}
+
+kvm::run_loop::action handle_pio(device& dev, uint16_t port, bool out,
+                                 void *data, unsigned size, unsigned count)
+{
+    dev.access(*static_cast<uint32_t*>(data));
+    return kvm::run_loop::resume;
+}
+
+kvm::run_loop::action handle_mmio(device& dev, uint64_t gpa, bool write,
+                                  void *data, unsigned len)
+{
+    dev.access(*static_cast<uint32_t*>(data));
+    return kvm::run_loop::resume;
+}
+
+kvm::run_loop::action handle_hlt(device& dev, kvm_run *run)
+{
+    dev.access(0);
+    return kvm::run_loop::resume;
+}
+
+kvm::run_loop::action guest_exit(uint16_t port, bool out, void *data,
+                                 unsigned size, unsigned count)
+{
+    return kvm::run_loop::stop;
+}
+
+void run_vcpu(const bench_options& opt, kvm::vcpu& vcpu)
+{
+    using namespace std::tr1::placeholders;
+    if (!pin(opt.vcpu_cpu)) {
+        return;
+    }
+    device dev(opt.mode, opt.device_cpu);
+    kvm::run_loop loop(vcpu);
+    loop.add_pio(bench_port, 4, std::tr1::bind(handle_pio, std::tr1::ref(dev),
+                                               _1, _2, _3, _4, _5));
+    loop.add_mmio(bench_mmio, 4096,
+                  std::tr1::bind(handle_mmio, std::tr1::ref(dev),
+                                 _1, _2, _3, _4));
+    loop.set_handler(KVM_EXIT_HLT, std::tr1::bind(handle_hlt,
+                                                  std::tr1::ref(dev), _1));
+    loop.add_pio(identity::exit_port, 1, guest_exit);
+    uint32_t reason = loop.run();
+    if (reason != KVM_EXIT_IO) {
+        fprintf(stderr, "unexpected exit %u\n", reason);
+    }
+}
+
+void report(const char* name, std::vector<uint64_t>& cycles, double tsc_ns)
+{
+    std::vector<uint64_t> ns(cycles.size());
+    for (unsigned i = 0; i < cycles.size(); ++i) {
+        ns[i] = uint64_t(cycles[i] / tsc_ns);
+    }
+    std::sort(ns.begin(), ns.end());
+    unsigned n = ns.size();
+    printf("%-5s min %8llu  p50 %8llu  p99 %8llu  max %8llu ns\n", name,
+           (unsigned long long)ns[0],
+           (unsigned long long)ns[(n - 1) * 50 / 100],
+           (unsigned long long)ns[(n - 1) * 99 / 100],
+           (unsigned long long)ns[n - 1]);
+    // power-of-two buckets
+    unsigned i = 0;
+    while (i < n) {
+        uint64_t lo = 1;
+        while (lo * 2 <= ns[i]) {
+            lo *= 2;
+        }
+        unsigned j = i;
+        while (j < n && ns[j] < lo * 2) {
+            ++j;
+        }
+        printf("      [%8llu, %8llu) %8u %6.2f%%\n",
+               (unsigned long long)(ns[i] ? lo : 0),
+               (unsigned long long)(lo * 2), j - i, 100.0 * (j - i) / n);
+        i = j;
+    }
+}
+
+const char* mode_names[] = { "inline", "poll", "block" };
+
+int usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-n samples] [-w warmup]"
+            " [-m inline|poll|block]\n"
+            "          [-c vcpu host cpu] [-d device thread host cpu]"
+            " [-s]\n",
+            prog);
+    return 2;
+}
+
+int test_main(int ac, char** av)
+{
+    bench_options opt;
+    int c;
+    while ((c = getopt(ac, av, "n:w:m:c:d:s")) != -1) {
+        switch (c) {
+        case 'n':
+            opt.nr_samples = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            opt.nr_warmup = strtoul(optarg, NULL, 0);
+            break;
+        case 'm': {
+            unsigned i = 0;
+            while (i < 3 && strcmp(optarg, mode_names[i])) {
+                ++i;
+            }
+            if (i == 3) {
+                return usage(av[0]);
+            }
+            opt.mode = handling(i);
+            break;
+        }
+        case 'c':
+            opt.vcpu_cpu = atoi(optarg);
+            break;
+        case 'd':
+            opt.device_cpu = atoi(optarg);
+            break;
+        case 's':
+            opt.kvm_stats = true;
+            break;
+        default:
+            return usage(av[0]);
+        }
+    }
+    if (!opt.nr_samples) {
+        return usage(av[0]);
+    }
+
+    kvm::system sys;
+    kvm::vm vm(sys);
+    mem_map memmap(vm);
+    identity::vm ident_vm(vm, memmap);
+    samples s(opt.nr_samples);
+    using namespace std::tr1::placeholders;
+    identity::vcpu_set vcpus(vm, 1, std::tr1::bind(guest_main,
+                                                   std::tr1::cref(opt),
+                                                   std::tr1::ref(s), _1));
+    std::auto_ptr<kvm::stats_delta> vm_delta, vcpu_delta;
+    if (opt.kvm_stats) {
+        vm_delta.reset(new kvm::stats_delta(vm.stats()));
+        vcpu_delta.reset(new kvm::stats_delta(vcpus[0].stats()));
+        vm_delta->begin();
+        vcpu_delta->begin();
+    }
+    vcpus.start(std::tr1::bind(run_vcpu, std::tr1::cref(opt), _1));
+    vcpus.join();
+    if (opt.kvm_stats) {
+        vcpu_delta->end();
+        vm_delta->end();
+    }
+
+    double tsc_ns = tsc_per_ns();
+    printf("%u exits of each type, %s handling\n", opt.nr_samples,
+           mode_names[opt.mode]);
+    report("pio", s.pio, tsc_ns);
+    report("mmio", s.mmio, tsc_ns);
+    report("hlt", s.hlt, tsc_ns);
+    if (opt.kvm_stats) {
+        printf("vm stats:\n");
+        vm_delta->print(stdout);
+        printf("vcpu stats:\n");
+        vcpu_delta->print(stdout);
+    }
+    return 0;
+}
+
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
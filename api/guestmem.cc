@@ -0,0 +1,68 @@
+
+#include "guestmem.hh"
+#include <string.h>
+#include <algorithm>
+
+guest_memory::iterator::iterator(const mem_map& map, uint64_t gpa,
+                                 uint64_t end)
+    : _map(&map), _end(end), _span()
+{
+    resolve(gpa);
+}
+
+void guest_memory::iterator::resolve(uint64_t gpa)
+{
+    if (gpa == _end) {
+        _span = span();
+        return;
+    }
+    mem_slot* slot = _map->find(gpa);
+    if (!slot) {
+        throw errno_exception(EFAULT);
+    }
+    uint64_t offset = gpa - slot->gpa();
+    _span.gpa = gpa;
+    _span.hva = static_cast<char*>(slot->hva()) + offset;
+    _span.size = std::min(slot->size() - offset, _end - gpa);
+}
+
+guest_memory::iterator& guest_memory::iterator::operator++()
+{
+    resolve(_span.gpa + _span.size);
+    return *this;
+}
+
+void* guest_memory::hva(uint64_t gpa, uint64_t size) const
+{
+    mem_slot* slot = _map.find(gpa);
+    if (!slot || gpa - slot->gpa() + size > slot->size()) {
+        throw errno_exception(EFAULT);
+    }
+    return static_cast<char*>(slot->hva()) + (gpa - slot->gpa());
+}
+
+guest_memory::iterator guest_memory::begin(uint64_t gpa, uint64_t size) const
+{
+    return iterator(_map, gpa, gpa + size);
+}
+
+void guest_memory::read(uint64_t gpa, void* buf, uint64_t size) const
+{
+    char* p = static_cast<char*>(buf);
+    for (iterator i = begin(gpa, size); i != end(); ++i) {
+        memcpy(p, i->hva, i->size);
+        p += i->size;
+    }
+}
+
+// resolves the whole range first, so that a hole leaves memory untouched
+void guest_memory::write(uint64_t gpa, const void* buf, uint64_t size) const
+{
+    for (iterator i = begin(gpa, size); i != end(); ++i) {
+    }
+    const char* p = static_cast<const char*>(buf);
+    for (iterator i = begin(gpa, size); i != end(); ++i) {
+        memcpy(i->hva, p, i->size);
+        p += i->size;
+    }
+}
@@ -0,0 +1,107 @@
+#ifndef API_GUESTMEM_HH
+#define API_GUESTMEM_HH
+
+#include "memmap.hh"
+#include "exception.hh"
+#include <stdint.h>
+#include <iterator>
+
+// Host access to guest physical memory through the slots of a mem_map.
+// Ranges resolve to host spans without copying; any part of a range that
+// no slot backs fails with EFAULT.  The slots must not change while a
+// resolved span is in use.
+class guest_memory {
+public:
+    struct span {
+        uint64_t gpa;
+        void* hva;
+        uint64_t size;
+    };
+    // Walks [gpa, gpa + size) one slot-contiguous span at a time, for
+    // ranges that cross slot boundaries.
+    class iterator : public std::iterator<std::forward_iterator_tag, span> {
+    public:
+        iterator() : _map(), _end(), _span() {}
+        const span& operator*() const { return _span; }
+        const span* operator->() const { return &_span; }
+        iterator& operator++();
+        iterator operator++(int) { iterator r = *this; ++*this; return r; }
+        bool operator==(const iterator& o) const {
+            return _span.size == o._span.size
+                && (!_span.size || _span.gpa == o._span.gpa);
+        }
+        bool operator!=(const iterator& o) const { return !(*this == o); }
+    private:
+        iterator(const mem_map& map, uint64_t gpa, uint64_t end);
+        void resolve(uint64_t gpa);
+    private:
+        const mem_map* _map;
+        uint64_t _end;
+        span _span;
+        friend class guest_memory;
+    };
+public:
+    explicit guest_memory(mem_map& map) : _map(map) {}
+    // the host address of [gpa, gpa + size), which must lie in one slot
+    void* hva(uint64_t gpa, uint64_t size) const;
+    iterator begin(uint64_t gpa, uint64_t size) const;
+    iterator end() const { return iterator(); }
+    void read(uint64_t gpa, void* buf, uint64_t size) const;
+    void write(uint64_t gpa, const void* buf, uint64_t size) const;
+    // Atomic accessors, for naturally aligned 1, 2, 4 or 8 byte values;
+    // order is one of the __ATOMIC_* constants.
+    template <typename T>
+    T load(uint64_t gpa, int order = __ATOMIC_SEQ_CST) const {
+        return __atomic_load_n(atomic_ptr<T>(gpa), order);
+    }
+    template <typename T>
+    void store(uint64_t gpa, T value, int order = __ATOMIC_SEQ_CST) const {
+        __atomic_store_n(atomic_ptr<T>(gpa), value, order);
+    }
+    template <typename T>
+    T exchange(uint64_t gpa, T value, int order = __ATOMIC_SEQ_CST) const {
+        return __atomic_exchange_n(atomic_ptr<T>(gpa), value, order);
+    }
+    template <typename T>
+    T fetch_add(uint64_t gpa, T value, int order = __ATOMIC_SEQ_CST) const {
+        return __atomic_fetch_add(atomic_ptr<T>(gpa), value, order);
+    }
+    template <typename T>
+    T fetch_or(uint64_t gpa, T value, int order = __ATOMIC_SEQ_CST) const {
+        return __atomic_fetch_or(atomic_ptr<T>(gpa), value, order);
+    }
+    template <typename T>
+    T fetch_and(uint64_t gpa, T value, int order = __ATOMIC_SEQ_CST) const {
+        return __atomic_fetch_and(atomic_ptr<T>(gpa), value, order);
+    }
+    // on failure, expected is updated to the current value
+    template <typename T>
+    bool compare_exchange(uint64_t gpa, T& expected, T desired,
+                          int order = __ATOMIC_SEQ_CST) const {
+        return __atomic_compare_exchange_n(atomic_ptr<T>(gpa), &expected,
+                                           desired, false, order,
+                                           failure_order(order));
+    }
+private:
+    template <typename T>
+    T* atomic_ptr(uint64_t gpa) const {
+        if (gpa % sizeof(T)) {
+            throw errno_exception(EINVAL);
+        }
+        return static_cast<T*>(hva(gpa, sizeof(T)));
+    }
+    // a failed compare-exchange cannot store, so drop any release part
+    static int failure_order(int order) {
+        if (order == __ATOMIC_ACQ_REL) {
+            return __ATOMIC_ACQUIRE;
+        }
+        if (order == __ATOMIC_RELEASE) {
+            return __ATOMIC_RELAXED;
+        }
+        return order;
+    }
+private:
+    mem_map& _map;
+};
+
+#endif
@@ -0,0 +1,175 @@
+#define _FILE_OFFSET_BITS 64
+
+#include "guestram.hh"
+#include "exception.hh"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB 0x0004U
+#endif
+#ifndef MFD_HUGE_SHIFT
+#define MFD_HUGE_SHIFT 26
+#endif
+#ifndef MFD_HUGE_2MB
+#define MFD_HUGE_2MB (21U << MFD_HUGE_SHIFT)
+#endif
+#ifndef MFD_HUGE_1GB
+#define MFD_HUGE_1GB (30U << MFD_HUGE_SHIFT)
+#endif
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0x8000
+#endif
+#ifndef MADV_HUGEPAGE
+#define MADV_HUGEPAGE 14
+#endif
+#ifndef MADV_NOHUGEPAGE
+#define MADV_NOHUGEPAGE 15
+#endif
+
+namespace {
+
+const size_t huge_2m = size_t(2) << 20;
+const size_t huge_1g = size_t(1) << 30;
+
+void *check_map(void *p)
+{
+    if (p == MAP_FAILED) {
+        throw errno_exception(errno);
+    }
+    return p;
+}
+
+size_t round_up(size_t n, size_t align)
+{
+    return (n + align - 1) & ~(align - 1);
+}
+
+size_t kind_page_size(guest_ram::backing kind)
+{
+    switch (kind) {
+    case guest_ram::transparent_huge:
+    case guest_ram::memfd_huge_2m:
+        return huge_2m;
+    case guest_ram::memfd_huge_1g:
+        return huge_1g;
+    default:
+        return ::getpagesize();
+    }
+}
+
+// MAP_POPULATE would fault pages in before a madvise() on the mapping took
+// effect, so the advised kinds prefault by touching each page instead
+void touch_pages(void *p, size_t size, size_t page_size)
+{
+    for (size_t off = 0; off < size; off += page_size) {
+        static_cast<volatile char *>(p)[off] = 0;
+    }
+}
+
+int create_memfd(guest_ram::backing kind, size_t size)
+{
+    unsigned flags = MFD_CLOEXEC;
+    switch (kind) {
+    case guest_ram::memfd:
+        break;
+    case guest_ram::memfd_huge_2m:
+        flags |= MFD_HUGETLB | MFD_HUGE_2MB;
+        break;
+    case guest_ram::memfd_huge_1g:
+        flags |= MFD_HUGETLB | MFD_HUGE_1GB;
+        break;
+    default:
+        return -1;
+    }
+    int fd = ::syscall(__NR_memfd_create, "guest-ram", flags);
+    if (fd == -1) {
+        throw errno_exception(errno);
+    }
+    if (::ftruncate(fd, size) == -1) {
+        int err = errno;
+        ::close(fd);
+        throw errno_exception(err);
+    }
+    return fd;
+}
+
+}
+
+guest_ram::guest_ram(size_t size, backing kind, bool prefault)
+    : _kind(kind)
+    , _size(round_up(size, kind_page_size(kind)))
+    , _fd(create_memfd(kind, _size))
+    , _map()
+    , _map_size(_size)
+    , _hva()
+{
+    int populate = prefault ? MAP_POPULATE : 0;
+    if (_fd.get() != -1) {
+        _map = check_map(::mmap(NULL, _map_size, PROT_READ | PROT_WRITE,
+                                MAP_SHARED | populate, _fd.get(), 0));
+        _hva = _map;
+        return;
+    }
+    if (kind != transparent_huge) {
+        // keep to small pages even with THP enabled system-wide
+        _map = check_map(::mmap(NULL, _map_size, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        _hva = _map;
+        if (::madvise(_hva, _size, MADV_NOHUGEPAGE) == -1) {
+            int err = errno;
+            ::munmap(_map, _map_size);
+            throw errno_exception(err);
+        }
+        if (prefault) {
+            touch_pages(_hva, _size, ::getpagesize());
+        }
+        return;
+    }
+    // over-allocate so that the region can start on a 2M boundary
+    _map_size = _size + huge_2m;
+    _map = check_map(::mmap(NULL, _map_size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    uintptr_t p = reinterpret_cast<uintptr_t>(_map);
+    _hva = reinterpret_cast<void *>(round_up(p, huge_2m));
+    if (::madvise(_hva, _size, MADV_HUGEPAGE) == -1) {
+        int err = errno;
+        ::munmap(_map, _map_size);
+        throw errno_exception(err);
+    }
+    if (prefault) {
+        touch_pages(_hva, _size, huge_2m);
+    }
+}
+
+guest_ram::~guest_ram()
+{
+    ::munmap(_map, _map_size);
+}
+
+size_t guest_ram::page_size() const
+{
+    return kind_page_size(_kind);
+}
+
+const char *guest_ram::name(backing kind)
+{
+    switch (kind) {
+    case anonymous:
+        return "anonymous";
+    case transparent_huge:
+        return "thp";
+    case memfd:
+        return "memfd";
+    case memfd_huge_2m:
+        return "memfd-2m";
+    case memfd_huge_1g:
+        return "memfd-1g";
+    }
+    return "?";
+}
@@ -0,0 +1,40 @@
+#ifndef API_GUESTRAM_HH
+#define API_GUESTRAM_HH
+
+#include <stddef.h>
+#include "kvmxx.hh"
+
+// Host memory to back a mem_slot.  anonymous and transparent_huge are
+// private anonymous mappings, madvise()d against and for THP respectively,
+// the latter aligned so that whole 2M pages fit; the memfd kinds are
+// shared mappings of a memfd, with hugetlbfs pages for the huge ones.
+// Sizes are rounded up to the page size of the backing.
+class guest_ram {
+public:
+    enum backing {
+        anonymous,
+        transparent_huge,
+        memfd,
+        memfd_huge_2m,
+        memfd_huge_1g,
+    };
+public:
+    guest_ram(size_t size, backing kind = anonymous, bool prefault = false);
+    ~guest_ram();
+    void *hva() const { return _hva; }
+    size_t size() const { return _size; }
+    backing kind() const { return _kind; }
+    size_t page_size() const;
+    // the memfd of the memfd kinds, -1 otherwise
+    int fd() { return _fd.get(); }
+    static const char *name(backing kind);
+private:
+    backing _kind;
+    size_t _size;
+    kvm::fd _fd;
+    void *_map;
+    size_t _map_size;
+    void *_hva;
+};
+
+#endif
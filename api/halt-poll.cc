@@ -0,0 +1,350 @@
+// Measures how quickly a halted identity vcpu wakes up, and how much host
+// CPU time it burns meanwhile, for a range of KVM_CAP_HALT_POLL values.
+// vcpu 0 halts with interrupts enabled; it is woken either by an IPI from
+// vcpu 1 or by an irqfd signalled from a host thread, after a set idle gap.
+
+#include "kvmxx.hh"
+#include "memmap.hh"
+#include "identity.hh"
+#include "kvmstats.hh"
+#include "exception.hh"
+#include <boost/thread/thread.hpp>
+#include <sched.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+namespace {
+
+const unsigned wake_vector = 0x40;
+// an I/O APIC pin above the 16 the PIC also sees
+const unsigned wake_gsi = 20;
+
+uint64_t rdtsc()
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return lo | (uint64_t(hi) << 32);
+}
+
+uint64_t now_ns(clockid_t clock = CLOCK_MONOTONIC)
+{
+    timespec ts;
+    clock_gettime(clock, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+double tsc_per_ns()
+{
+    uint64_t t0 = now_ns(), c0 = rdtsc();
+    usleep(100000);
+    uint64_t t1 = now_ns(), c1 = rdtsc();
+    return double(c1 - c0) / (t1 - t0);
+}
+
+bool pin(int cpu)
+{
+    if (cpu < 0) {
+        return true;
+    }
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+    if (sched_setaffinity(0, sizeof(mask), &mask) == -1) {
+        perror("sched_setaffinity");
+        return false;
+    }
+    return true;
+}
+
+enum wake_mode { wake_ipi, wake_irqfd };
+
+const char* mode_names[] = { "ipi", "irqfd" };
+
+struct bench_options {
+    bench_options()
+        : nr_samples(10000), gap_us(50), mode(wake_ipi)
+        , sleeper_cpu(-1), waker_cpu(-1), kvm_stats(false) {}
+    unsigned nr_samples;
+    unsigned gap_us;
+    wake_mode mode;
+    std::vector<uint64_t> poll_ns;
+    int sleeper_cpu;
+    int waker_cpu;
+    bool kvm_stats;
+};
+
+// Shared by the guest, its interrupt handler and the waker.  The sleeper
+// raises ready with interrupts off and then halts with sti; hlt, so a
+// wakeup sent once ready is seen cannot be lost.
+struct wake_state {
+    volatile uint32_t ready;
+    volatile uint32_t wakes;
+};
+
+wake_state state;
+
+void wake_handler(unsigned vector)
+{
+    ++state.wakes;
+}
+
+// runs in the guest, on vcpu 0
+void sleeper(const bench_options& opt)
+{
+    identity::lapic_enable();
+    if (opt.mode == wake_irqfd) {
+        identity::ioapic_route(wake_gsi, wake_vector, 0);
+    }
+    for (unsigned i = 0; i < opt.nr_samples; ++i) {
+        asm volatile("cli");
+        state.ready = 1;
+        asm volatile("sti; hlt" : : : "memory");
+    }
+}
+
+void spin_cycles(uint64_t cycles)
+{
+    uint64_t t = rdtsc();
+    while (rdtsc() - t < cycles) {
+        asm volatile("pause");
+    }
+}
+
+void send_ipi()
+{
+    identity::send_ipi(0, wake_vector);
+}
+
+// Runs in the guest on vcpu 1, or on a host thread for irqfd wakeups.  A
+// wakeup is timed from the send until the waker sees the handler's count
+// change, so both ends are read from the waker's own TSC; the guest's TSC
+// is offset from the host's.
+void waker(const bench_options& opt, uint64_t gap_cycles,
+           std::tr1::function<void ()> send, std::vector<uint64_t>& cycles)
+{
+    for (unsigned i = 0; i < opt.nr_samples; ++i) {
+        while (!state.ready) {
+            asm volatile("pause");
+        }
+        state.ready = 0;
+        spin_cycles(gap_cycles);
+        uint32_t wakes = state.wakes;
+        uint64_t t = rdtsc();
+        send();
+        while (state.wakes == wakes) {
+            asm volatile("pause");
+        }
+        cycles[i] = rdtsc() - t;
+    }
+}
+
+void guest_main(const bench_options& opt, uint64_t gap_cycles,
+                std::vector<uint64_t>& cycles, unsigned cpu)
+{
+    if (cpu == 0) {
+        sleeper(opt);
+    } else {
+        identity::lapic_enable();
+        waker(opt, gap_cycles, send_ipi, cycles);
+    }
+}
+
+struct run_result {
+    run_result() : sleeper_cpu_ns(), wall_ns(), ok(true) {}
+    uint64_t sleeper_cpu_ns;
+    uint64_t wall_ns;
+    bool ok;
+};
+
+// vcpu 0's thread time includes any halt polling done in KVM_RUN
+void run_vcpu(const bench_options& opt, identity::vcpu_set& vcpus,
+              run_result& r, kvm::vcpu& vcpu)
+{
+    bool is_sleeper = &vcpu == &vcpus[0];
+    if (!pin(is_sleeper ? opt.sleeper_cpu : opt.waker_cpu)) {
+        r.ok = false;
+        return;
+    }
+    uint64_t t = now_ns(CLOCK_THREAD_CPUTIME_ID);
+    vcpu.run();
+    if (is_sleeper) {
+        r.sleeper_cpu_ns = now_ns(CLOCK_THREAD_CPUTIME_ID) - t;
+    }
+    if (vcpu.shared()->exit_reason != KVM_EXIT_IO) {
+        fprintf(stderr, "unexpected exit %u\n", vcpu.shared()->exit_reason);
+        r.ok = false;
+    }
+}
+
+void host_waker(const bench_options& opt, uint64_t gap_cycles,
+                kvm::eventfd& efd, std::vector<uint64_t>& cycles)
+{
+    pin(opt.waker_cpu);
+    waker(opt, gap_cycles, std::tr1::bind(&kvm::eventfd::write,
+                                          std::tr1::ref(efd), 1),
+          cycles);
+}
+
+uint64_t percentile(const std::vector<uint64_t>& sorted, unsigned pct)
+{
+    return sorted[(sorted.size() - 1) * pct / 100];
+}
+
+bool run_one(kvm::system& sys, const bench_options& opt, uint64_t poll_ns,
+             double tsc_ns)
+{
+    kvm::vm vm(sys);
+    vm.create_irqchip();
+    if (sys.check_extension(KVM_CAP_HALT_POLL)) {
+        vm.enable_cap(KVM_CAP_HALT_POLL, poll_ns);
+    }
+    mem_map memmap(vm);
+    identity::vm ident_vm(vm, memmap);
+    kvm::eventfd efd;
+    if (opt.mode == wake_irqfd) {
+        vm.add_irqfd(efd.get(), wake_gsi);
+    }
+
+    state.ready = 0;
+    state.wakes = 0;
+    identity::set_irq_handler(wake_vector, wake_handler);
+    std::vector<uint64_t> cycles(opt.nr_samples);
+    uint64_t gap_cycles = uint64_t(opt.gap_us * 1000 * tsc_ns);
+    using namespace std::tr1::placeholders;
+    unsigned nr_vcpus = opt.mode == wake_ipi ? 2 : 1;
+    identity::vcpu_set vcpus(vm, nr_vcpus,
+                             std::tr1::bind(guest_main, std::tr1::cref(opt),
+                                            gap_cycles, std::tr1::ref(cycles),
+                                            _1));
+    std::auto_ptr<kvm::stats_delta> delta;
+    if (opt.kvm_stats) {
+        delta.reset(new kvm::stats_delta(vcpus[0].stats()));
+        delta->begin();
+    }
+    run_result r;
+    uint64_t t = now_ns();
+    vcpus.start(std::tr1::bind(run_vcpu, std::tr1::cref(opt),
+                               std::tr1::ref(vcpus), std::tr1::ref(r), _1));
+    if (opt.mode == wake_irqfd) {
+        host_waker(opt, gap_cycles, efd, cycles);
+    }
+    vcpus.join();
+    r.wall_ns = now_ns() - t;
+    if (!r.ok) {
+        return false;
+    }
+    if (delta.get()) {
+        delta->end();
+    }
+
+    std::vector<uint64_t> ns(cycles.size());
+    for (unsigned i = 0; i < cycles.size(); ++i) {
+        ns[i] = uint64_t(cycles[i] / tsc_ns);
+    }
+    std::sort(ns.begin(), ns.end());
+    printf("%10llu %8llu %8llu %8llu %8llu %10.2f %6.1f%%\n",
+           (unsigned long long)poll_ns,
+           (unsigned long long)percentile(ns, 50),
+           (unsigned long long)percentile(ns, 90),
+           (unsigned long long)percentile(ns, 99),
+           (unsigned long long)ns.back(),
+           double(r.sleeper_cpu_ns) / opt.nr_samples / 1000,
+           100.0 * r.sleeper_cpu_ns / r.wall_ns);
+    if (delta.get()) {
+        delta->print(stdout);
+    }
+    return true;
+}
+
+void parse_poll_values(char* s, std::vector<uint64_t>& values)
+{
+    for (char* tok = strtok(s, ","); tok; tok = strtok(NULL, ",")) {
+        values.push_back(strtoull(tok, NULL, 0));
+    }
+}
+
+int usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-n samples] [-g idle gap us] [-m ipi|irqfd]"
+            " [-p poll ns,...]\n"
+            "          [-c sleeper host cpu] [-w waker host cpu] [-s]\n",
+            prog);
+    return 2;
+}
+
+int test_main(int ac, char** av)
+{
+    bench_options opt;
+    int c;
+    while ((c = getopt(ac, av, "n:g:m:p:c:w:s")) != -1) {
+        switch (c) {
+        case 'n':
+            opt.nr_samples = strtoul(optarg, NULL, 0);
+            break;
+        case 'g':
+            opt.gap_us = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            if (!strcmp(optarg, "ipi")) {
+                opt.mode = wake_ipi;
+            } else if (!strcmp(optarg, "irqfd")) {
+                opt.mode = wake_irqfd;
+            } else {
+                return usage(av[0]);
+            }
+            break;
+        case 'p':
+            parse_poll_values(optarg, opt.poll_ns);
+            break;
+        case 'c':
+            opt.sleeper_cpu = atoi(optarg);
+            break;
+        case 'w':
+            opt.waker_cpu = atoi(optarg);
+            break;
+        case 's':
+            opt.kvm_stats = true;
+            break;
+        default:
+            return usage(av[0]);
+        }
+    }
+    if (!opt.nr_samples) {
+        return usage(av[0]);
+    }
+    if (opt.poll_ns.empty()) {
+        uint64_t defaults[] = { 0, 10000, 50000, 200000, 1000000 };
+        opt.poll_ns.assign(defaults, defaults + 5);
+    }
+
+    kvm::system sys;
+    if (!sys.check_extension(KVM_CAP_HALT_POLL)) {
+        fprintf(stderr, "no KVM_CAP_HALT_POLL; using the host's"
+                " halt_poll_ns for every run\n");
+        opt.poll_ns.resize(1);
+    }
+    double tsc_ns = tsc_per_ns();
+    printf("%u %s wakeups per run, %u us idle gap\n", opt.nr_samples,
+           mode_names[opt.mode], opt.gap_us);
+    printf("%10s %8s %8s %8s %8s %10s %7s\n", "poll_ns", "p50_ns", "p90_ns",
+           "p99_ns", "max_ns", "cpu_us/wk", "cpu");
+    for (unsigned i = 0; i < opt.poll_ns.size(); ++i) {
+        if (!run_one(sys, opt, opt.poll_ns[i], tsc_ns)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
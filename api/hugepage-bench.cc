@@ -0,0 +1,202 @@
+// Compares a TLB-miss-heavy guest workload (a pointer chase touching one
+// cache line per page, in random page order) across the guest_ram
+// backings.  The identity guest runs without paging, so its misses are
+// resolved through the host's second-level tables, whose page size
+// follows the backing.
+
+#include "kvmxx.hh"
+#include "memmap.hh"
+#include "identity.hh"
+#include "guestram.hh"
+#include "exception.hh"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+namespace {
+
+const unsigned nr_backings = 5;
+
+uint64_t rdtsc()
+{
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return lo | (uint64_t(hi) << 32);
+}
+
+uint64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+struct chase {
+    void** start;
+    unsigned long nr_pages;
+    unsigned long steps;
+    uint64_t cycles;
+    void* volatile end;
+};
+
+// Links one pointer per page into a single random cycle.  The line within
+// each page varies too, so the chase is not limited by cache set conflicts.
+void build_chain(guest_ram& ram, chase& c)
+{
+    unsigned long page_size = ::getpagesize();
+    unsigned long nr_pages = ram.size() / page_size;
+    char* base = static_cast<char*>(ram.hva());
+    std::vector<unsigned long> order(nr_pages);
+    for (unsigned long i = 0; i < nr_pages; ++i) {
+        order[i] = i;
+    }
+    srand(1);
+    for (unsigned long i = nr_pages - 1; i > 0; --i) {
+        std::swap(order[i], order[rand() % (i + 1)]);
+    }
+    std::vector<void**> slot(nr_pages);
+    for (unsigned long i = 0; i < nr_pages; ++i) {
+        unsigned long line = (order[i] * 7) % (page_size / 64);
+        slot[i] = reinterpret_cast<void**>(base + order[i] * page_size
+                                           + line * 64);
+    }
+    for (unsigned long i = 0; i < nr_pages; ++i) {
+        *slot[i] = slot[(i + 1) % nr_pages];
+    }
+    c.start = slot[0];
+    c.nr_pages = nr_pages;
+}
+
+void* walk(void** p, unsigned long steps)
+{
+    while (steps--) {
+        p = static_cast<void**>(*p);
+    }
+    return p;
+}
+
+// one full pass first, so that faulting in the second-level tables is not
+// counted
+void guest_chase(chase* c)
+{
+    c->end = walk(c->start, c->nr_pages);
+    uint64_t t = rdtsc();
+    c->end = walk(c->start, c->steps);
+    c->cycles = rdtsc() - t;
+}
+
+kvm::run_loop::action guest_exit(uint16_t port, bool out, void* data,
+                                 unsigned size, unsigned count)
+{
+    return kvm::run_loop::stop;
+}
+
+void run_backing(kvm::system& sys, guest_ram::backing kind, size_t size,
+                 bool prefault, unsigned long steps)
+{
+    const char* name = guest_ram::name(kind);
+    uint64_t t = now_ns();
+    std::auto_ptr<guest_ram> ram;
+    try {
+        ram.reset(new guest_ram(size, kind, prefault));
+    } catch (errno_exception& e) {
+        printf("%-10s unavailable: %s\n", name, e.what());
+        return;
+    }
+    // allocation and prefaulting only; the chain is the same work for
+    // every backing
+    uint64_t setup = now_ns() - t;
+    uint64_t gpa = reinterpret_cast<unsigned long>(ram->hva());
+    if (gpa + ram->size() > (3ULL << 30)) {
+        printf("%-10s unavailable: mapped above the identity range\n", name);
+        return;
+    }
+    chase c = {};
+    c.steps = steps;
+    build_chain(*ram, c);
+
+    kvm::vm vm(sys);
+    mem_map memmap(vm);
+    identity::vm ident_vm(vm, memmap,
+                          identity::hole(ram->hva(), ram->size()));
+    mem_slot slot(memmap, gpa, ram->size(), ram->hva());
+    kvm::vcpu vcpu(vm, 0);
+    identity::vcpu thread(vcpu, std::tr1::bind(guest_chase, &c));
+    kvm::run_loop loop(vcpu);
+    loop.add_pio(identity::exit_port, 1, guest_exit);
+    loop.run();
+
+    printf("%-10s %8.2f cycles/access  setup %8.3f ms\n", name,
+           double(c.cycles) / steps, setup / 1e6);
+}
+
+int usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-m MiB] [-n steps] [-p]"
+            " [-b anonymous|thp|memfd|memfd-2m|memfd-1g]...\n", prog);
+    return 2;
+}
+
+int test_main(int ac, char** av)
+{
+    unsigned mem_mb = 512;
+    unsigned long steps = 1 << 24;
+    bool prefault = false;
+    std::vector<guest_ram::backing> kinds;
+    int c;
+    while ((c = getopt(ac, av, "m:n:pb:")) != -1) {
+        switch (c) {
+        case 'm':
+            mem_mb = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            steps = strtoul(optarg, NULL, 0);
+            break;
+        case 'p':
+            prefault = true;
+            break;
+        case 'b': {
+            unsigned i = 0;
+            while (i < nr_backings
+                   && strcmp(optarg, guest_ram::name(guest_ram::backing(i)))) {
+                ++i;
+            }
+            if (i == nr_backings) {
+                return usage(av[0]);
+            }
+            kinds.push_back(guest_ram::backing(i));
+            break;
+        }
+        default:
+            return usage(av[0]);
+        }
+    }
+    if (!mem_mb || !steps) {
+        return usage(av[0]);
+    }
+    if (kinds.empty()) {
+        for (unsigned i = 0; i < nr_backings; ++i) {
+            kinds.push_back(guest_ram::backing(i));
+        }
+    }
+
+    kvm::system sys;
+    printf("%u MiB, %lu steps%s\n", mem_mb, steps,
+           prefault ? ", prefaulted" : "");
+    for (unsigned i = 0; i < kinds.size(); ++i) {
+        run_backing(sys, kinds[i], size_t(mem_mb) << 20, prefault, steps);
+    }
+    return 0;
+}
+
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
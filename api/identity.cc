@@ -2,10 +2,158 @@
 #include "identity.hh"
 #include <stdio.h>
 
+// Interrupt entry: one 16-byte stub per vector pushes the vector number
+// and joins common code that saves the registers, calls
+// identity_irq_dispatch() on a 16-byte aligned stack, and returns with
+// iret.  Identity guests run 32-bit code only.
+#ifdef __i386__
+asm(".pushsection .text\n"
+    ".p2align 4\n"
+    "identity_irq_stubs:\n"
+    ".set vector, 0\n"
+    ".rept 256\n"
+    ".p2align 4\n"
+    "pushl $vector\n"
+    "jmp identity_irq_common\n"
+    ".set vector, vector + 1\n"
+    ".endr\n"
+    "identity_irq_common:\n"
+    "pushal\n"
+    "movl %esp, %ebp\n"
+    "andl $-16, %esp\n"
+    "subl $12, %esp\n"
+    "pushl 32(%ebp)\n"
+    "cld\n"
+    "call identity_irq_dispatch\n"
+    "movl %ebp, %esp\n"
+    "popal\n"
+    "addl $4, %esp\n"
+    "iret\n"
+    ".popsection");
+
+extern "C" char identity_irq_stubs[];
+#endif
+
 namespace identity {
 
 typedef unsigned long ulong;
 
+namespace {
+
+const uint32_t lapic_base = 0xfee00000;
+const uint32_t lapic_tpr = 0x80;
+const uint32_t lapic_eoi = 0xb0;
+const uint32_t lapic_svr = 0xf0;
+const uint32_t lapic_icr_low = 0x300;
+const uint32_t lapic_icr_high = 0x310;
+const uint32_t ioapic_base = 0xfec00000;
+const uint32_t ioapic_regsel = 0x00;
+const uint32_t ioapic_win = 0x10;
+
+const unsigned first_irq_vector = 32;
+const unsigned gdt_entries = 32;
+
+irq_handler irq_handlers[256];
+
+void mmio_write(uint32_t addr, uint32_t value)
+{
+    *reinterpret_cast<volatile uint32_t*>(static_cast<ulong>(addr)) = value;
+}
+
+// Flat 4G segments at DPL 0, placed at the indexes of the host's
+// selectors so that the selectors the guest runs with stay valid when an
+// interrupt or iret reloads them.
+struct descriptor_tables {
+    descriptor_tables();
+    uint64_t gdt[gdt_entries];
+    uint64_t idt[256];
+};
+
+void set_flat_segment(uint64_t* gdt, uint16_t selector, bool code)
+{
+    unsigned index = selector >> 3;
+    if (index && index < gdt_entries) {
+        gdt[index] = code ? 0x00cf9b000000ffffULL : 0x00cf93000000ffffULL;
+    }
+}
+
+descriptor_tables::descriptor_tables()
+    : gdt(), idt()
+{
+    uint16_t cs, ds, es, fs, gs, ss;
+    asm ("mov %%cs, %0" : "=rm"(cs));
+    asm ("mov %%ds, %0" : "=rm"(ds));
+    asm ("mov %%es, %0" : "=rm"(es));
+    asm ("mov %%fs, %0" : "=rm"(fs));
+    asm ("mov %%gs, %0" : "=rm"(gs));
+    asm ("mov %%ss, %0" : "=rm"(ss));
+    set_flat_segment(gdt, ds, false);
+    set_flat_segment(gdt, es, false);
+    set_flat_segment(gdt, fs, false);
+    set_flat_segment(gdt, gs, false);
+    set_flat_segment(gdt, ss, false);
+    set_flat_segment(gdt, cs, true);
+#ifdef __i386__
+    // 32-bit interrupt gates, DPL 0
+    for (unsigned v = first_irq_vector; v < 256; ++v) {
+        uint32_t entry = reinterpret_cast<ulong>(identity_irq_stubs + v * 16);
+        idt[v] = (entry & 0xffff) | (uint64_t(cs & ~3) << 16)
+            | (uint64_t(0x8e00) << 32) | (uint64_t(entry >> 16) << 48);
+    }
+#endif
+}
+
+descriptor_tables& tables()
+{
+    static descriptor_tables t;
+    return t;
+}
+
+}
+
+void set_irq_handler(unsigned vector, irq_handler handler)
+{
+    irq_handlers[vector] = handler;
+}
+
+void lapic_enable()
+{
+    mmio_write(lapic_base + lapic_tpr, 0);
+    mmio_write(lapic_base + lapic_svr, 0x1ff);
+}
+
+void lapic_eoi_write()
+{
+    mmio_write(lapic_base + lapic_eoi, 0);
+}
+
+// fixed delivery, physical destination, edge triggered
+void send_ipi(unsigned apic_id, unsigned vector)
+{
+    mmio_write(lapic_base + lapic_icr_high, apic_id << 24);
+    mmio_write(lapic_base + lapic_icr_low, 0x4000 | vector);
+}
+
+void ioapic_route(unsigned pin, unsigned vector, unsigned apic_id)
+{
+    mmio_write(ioapic_base + ioapic_regsel, 0x11 + pin * 2);
+    mmio_write(ioapic_base + ioapic_win, apic_id << 24);
+    mmio_write(ioapic_base + ioapic_regsel, 0x10 + pin * 2);
+    mmio_write(ioapic_base + ioapic_win, vector);
+}
+
+}
+
+extern "C" __attribute__((used)) void identity_irq_dispatch(unsigned vector)
+{
+    if (identity::irq_handlers[vector]) {
+        identity::irq_handlers[vector](vector);
+    }
+    identity::lapic_eoi_write();
+}
+
+namespace identity {
+
 hole::hole()
     : address(), size()
 {
@@ -36,16 +184,30 @@ void vcpu::setup_sregs()
     kvm_sregs sregs = { };
     kvm_segment dseg = { };
     dseg.base = 0; dseg.limit = -1U; dseg.type = 3; dseg.present = 1;
-    dseg.dpl = 3; dseg.db = 1; dseg.s = 1; dseg.l = 0; dseg.g = 1;
+    dseg.dpl = 0; dseg.db = 1; dseg.s = 1; dseg.l = 0; dseg.g = 1;
     kvm_segment cseg = dseg;
     cseg.type = 11;
 
+    // CPL 0, so that hlt does not fault and interrupts return to the same
+    // privilege level; the selectors drop the host's RPL of 3 to match.
     sregs.cs = cseg; asm ("mov %%cs, %0" : "=rm"(sregs.cs.selector));
     sregs.ds = dseg; asm ("mov %%ds, %0" : "=rm"(sregs.ds.selector));
     sregs.es = dseg; asm ("mov %%es, %0" : "=rm"(sregs.es.selector));
     sregs.fs = dseg; asm ("mov %%fs, %0" : "=rm"(sregs.fs.selector));
     sregs.gs = dseg; asm ("mov %%gs, %0" : "=rm"(sregs.gs.selector));
     sregs.ss = dseg; asm ("mov %%ss, %0" : "=rm"(sregs.ss.selector));
+    sregs.cs.selector &= ~3;
+    sregs.ds.selector &= ~3;
+    sregs.es.selector &= ~3;
+    sregs.fs.selector &= ~3;
+    sregs.gs.selector &= ~3;
+    sregs.ss.selector &= ~3;
+
+    descriptor_tables& t = tables();
+    sregs.gdt.base = reinterpret_cast<ulong>(t.gdt);
+    sregs.gdt.limit = sizeof(t.gdt) - 1;
+    sregs.idt.base = reinterpret_cast<ulong>(t.idt);
+    sregs.idt.limit = sizeof(t.idt) - 1;
 
     uint32_t gsbase;
     asm ("mov %%gs:0, %0" : "=r"(gsbase));
@@ -66,7 +228,7 @@ void vcpu::setup_sregs()
 void vcpu::thunk(vcpu* zis)
 {
     zis->_guest_func();
-    asm volatile("outb %%al, %%dx" : : "a"(0), "d"(0));
+    asm volatile("outb %%al, %%dx" : : "a"(0), "d"(exit_port));
 }
 
 void vcpu::setup_regs()
@@ -90,6 +252,70 @@ vcpu::vcpu(kvm::vcpu& vcpu, std::tr1::function<void ()> guest_func,
 {
     setup_sregs();
     setup_regs();
+    // with an in-kernel irqchip, all but the first vcpu would otherwise
+    // wait for INIT/SIPI
+    _vcpu.set_mp_state(KVM_MP_STATE_RUNNABLE);
+}
+
+static void enter_guest(std::tr1::function<void ()> guest_func,
+                        unsigned long stack_size, kvm::vcpu& vcpu,
+                        vcpu_executor::run_func run)
+{
+    identity::vcpu ident(vcpu, guest_func, stack_size);
+    run();
+}
+
+vcpu_executor::enter_func enter(std::tr1::function<void ()> guest_func,
+                                unsigned long stack_size)
+{
+    using namespace std::tr1::placeholders;
+    return std::tr1::bind(enter_guest, guest_func, stack_size, _1, _2);
+}
+
+vcpu_set::vcpu_set(kvm::vm& vm, unsigned nr_vcpus, guest_func func,
+                   unsigned long stack_size)
+    : _func(func), _stack_size(stack_size), _barrier(nr_vcpus + 1)
+{
+    for (unsigned i = 0; i < nr_vcpus; ++i) {
+        _vcpus.push_back(vcpu_ptr(new kvm::vcpu(vm, i)));
+    }
+}
+
+vcpu_set::~vcpu_set()
+{
+    join();
+}
+
+void vcpu_set::run_once(kvm::vcpu& vcpu)
+{
+    vcpu.run();
+}
+
+void vcpu_set::start()
+{
+    start(run_once);
+}
+
+// Returns once every vcpu thread is set up and about to enter the guest.
+void vcpu_set::start(run_func run)
+{
+    for (unsigned i = 0; i < _vcpus.size(); ++i) {
+        _threads.create_thread(std::tr1::bind(&vcpu_set::thread_main, this,
+                                              i, run));
+    }
+    _barrier.wait();
+}
+
+void vcpu_set::join()
+{
+    _threads.join_all();
+}
+
+void vcpu_set::thread_main(unsigned cpu, run_func run)
+{
+    vcpu ident(*_vcpus[cpu], std::tr1::bind(_func, cpu), _stack_size);
+    _barrier.wait();
+    run(*_vcpus[cpu]);
 }
 
 }
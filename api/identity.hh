@@ -3,12 +3,32 @@
 
 #include "kvmxx.hh"
 #include "memmap.hh"
+#include "executor.hh"
 #include <tr1/functional>
 #include <tr1/memory>
 #include <vector>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/barrier.hpp>
 
 namespace identity {
 
+// port written by the guest when its function returns
+const uint16_t exit_port = 0;
+
+// Identity guests run at CPL 0 with a GDT and an IDT whose vectors 32-255
+// call the handler registered for the vector, if any, and then signal EOI
+// to the local APIC.  Interrupts need an in-kernel irqchip, created before
+// the vcpus, and a guest that has enabled its local APIC; exceptions
+// (vectors 0-31) still shut the vm down.
+typedef void (*irq_handler)(unsigned vector);
+void set_irq_handler(unsigned vector, irq_handler handler);
+
+// Called from guest code.
+void lapic_enable();
+void send_ipi(unsigned apic_id, unsigned vector);
+// routes an I/O APIC pin (an irqfd gsi) to a vector on a vcpu
+void ioapic_route(unsigned pin, unsigned vector, unsigned apic_id);
+
 struct hole {
     hole();
     hole(void* address, size_t size);
@@ -38,6 +58,39 @@ private:
     std::vector<char> _stack;
 };
 
+// A vcpu_executor enter function that runs guest_func on the vcpu as an
+// identity guest.
+vcpu_executor::enter_func enter(std::tr1::function<void ()> guest_func,
+                                unsigned long stack_size = 256 * 1024);
+
+// A set of vcpus, each running its guest function on its own host thread.
+// The identity setup (stack, TR, and GS from the thread's TLS) is done on
+// that thread, and all threads enter the guest together once started.
+class vcpu_set {
+public:
+    typedef std::tr1::function<void (unsigned cpu)> guest_func;
+    typedef std::tr1::function<void (kvm::vcpu& vcpu)> run_func;
+public:
+    vcpu_set(kvm::vm& vm, unsigned nr_vcpus, guest_func func,
+             unsigned long stack_size = 256 * 1024);
+    ~vcpu_set();
+    unsigned size() const { return _vcpus.size(); }
+    kvm::vcpu& operator[](unsigned cpu) { return *_vcpus[cpu]; }
+    void start();
+    void start(run_func run);
+    void join();
+private:
+    static void run_once(kvm::vcpu& vcpu);
+    void thread_main(unsigned cpu, run_func run);
+private:
+    typedef std::tr1::shared_ptr<kvm::vcpu> vcpu_ptr;
+    std::vector<vcpu_ptr> _vcpus;
+    guest_func _func;
+    unsigned long _stack_size;
+    boost::barrier _barrier;
+    boost::thread_group _threads;
+};
+
 }
 
 #endif
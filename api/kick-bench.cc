@@ -0,0 +1,313 @@
+// Measures how long it takes to force a running vcpu out of KVM_RUN from
+// another thread, with vcpu::kick() and with a plain signal to the vcpu
+// thread, and counts the kicks that never cause an exit.  A plain signal
+// is lost if it lands while the vcpu thread is between two KVM_RUNs; -e
+// runs a guest that exits to userspace continuously to widen that window.
+
+#include "kvmxx.hh"
+#include "memmap.hh"
+#include "exception.hh"
+#include <boost/thread/thread.hpp>
+#include <sys/mman.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+namespace {
+
+uint64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+bool pin(int cpu)
+{
+    if (cpu < 0) {
+        return true;
+    }
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+    if (sched_setaffinity(0, sizeof(mask), &mask) == -1) {
+        perror("sched_setaffinity");
+        return false;
+    }
+    return true;
+}
+
+enum kick_mode { mode_kick, mode_signal };
+
+const char* mode_names[] = { "kick", "signal" };
+
+struct bench_options {
+    bench_options()
+        : nr_samples(10000), gap_us(100), timeout_ms(10), exiting(false)
+        , runner_cpu(-1), kicker_cpu(-1) {
+        modes.push_back(mode_kick);
+        modes.push_back(mode_signal);
+    }
+    unsigned nr_samples;
+    unsigned gap_us;
+    unsigned timeout_ms;
+    bool exiting;
+    std::vector<kick_mode> modes;
+    int runner_cpu;
+    int kicker_cpu;
+};
+
+// The kicker numbers each kick in seq; the vcpu thread answers the first
+// exit it sees for a number with latency_ns and the number in echo, then
+// writes the eventfd.  A kick that timed out can still cause an exit
+// later, and its answer then carries an old number.
+struct runner_state {
+    pthread_t thread;
+    uint64_t seq;
+    uint64_t sent_ns;
+    uint64_t echo;
+    uint64_t latency_ns;
+    bool done;
+    bool failed;
+};
+
+// Real-mode guests at address 0: either "1: jmp 1b", or
+// "1: out 0x80, al; jmp 1b" to exit on every iteration.
+void load_guest(char* mem, bool exiting)
+{
+    const unsigned char spin[] = { 0xeb, 0xfe };
+    const unsigned char io[] = { 0xe6, 0x80, 0xeb, 0xfc };
+    if (exiting) {
+        memcpy(mem, io, sizeof(io));
+    } else {
+        memcpy(mem, spin, sizeof(spin));
+    }
+}
+
+void reset_vcpu(kvm::vcpu& vcpu)
+{
+    kvm_sregs sregs = vcpu.sregs();
+    sregs.cs.base = 0;
+    sregs.cs.selector = 0;
+    vcpu.set_sregs(sregs);
+    kvm_regs regs = {};
+    regs.rflags = 2;
+    vcpu.set_regs(regs);
+}
+
+void runner(const bench_options& opt, kick_mode mode, kvm::vcpu& vcpu,
+            kvm::eventfd& efd, runner_state& st)
+{
+    pin(opt.runner_cpu);
+    st.thread = pthread_self();
+    efd.write(1);
+    kvm_run* run = vcpu.shared();
+    uint64_t answered = 0;
+    for (;;) {
+        kvm::result<void> r = vcpu.try_run();
+        if (r.ok()) {
+            if (run->exit_reason == KVM_EXIT_IO) {
+                continue;
+            }
+            fprintf(stderr, "unexpected exit %u\n", run->exit_reason);
+            break;
+        } else if (r.error() != EINTR) {
+            fprintf(stderr, "KVM_RUN: %s\n", strerror(r.error()));
+            break;
+        }
+        uint64_t t = now_ns();
+        if (__atomic_load_n(&st.done, __ATOMIC_ACQUIRE)) {
+            return;
+        }
+        uint64_t seq = __atomic_load_n(&st.seq, __ATOMIC_ACQUIRE);
+        if (seq == answered) {
+            // a second exit for the same kick
+            continue;
+        }
+        answered = seq;
+        if (mode == mode_kick) {
+            st.latency_ns = vcpu.kick_latency();
+        } else {
+            st.latency_ns = t - st.sent_ns;
+        }
+        __atomic_store_n(&st.echo, seq, __ATOMIC_RELEASE);
+        efd.write(1);
+    }
+    st.failed = true;
+    efd.write(1);
+}
+
+bool wait_exit(kvm::eventfd& efd, int timeout_ms)
+{
+    pollfd pfd = { efd.get(), POLLIN, 0 };
+    int r = ::poll(&pfd, 1, timeout_ms);
+    if (r == -1) {
+        throw errno_exception(errno);
+    }
+    if (!r) {
+        return false;
+    }
+    efd.read();
+    return true;
+}
+
+uint64_t percentile(const std::vector<uint64_t>& sorted, unsigned pct)
+{
+    return sorted[(sorted.size() - 1) * pct / 100];
+}
+
+bool run_one(kvm::system& sys, const bench_options& opt, kick_mode mode,
+             char* mem, size_t mem_size)
+{
+    kvm::vm vm(sys);
+    mem_map memmap(vm);
+    mem_slot slot(memmap, 0, mem_size, mem);
+    kvm::vcpu vcpu(vm, 0);
+    reset_vcpu(vcpu);
+    kvm::eventfd efd;
+    runner_state st = {};
+    boost::thread thread(std::tr1::bind(runner, std::tr1::cref(opt), mode,
+                                        std::tr1::ref(vcpu),
+                                        std::tr1::ref(efd),
+                                        std::tr1::ref(st)));
+    pin(opt.kicker_cpu);
+    wait_exit(efd, -1);
+
+    std::vector<uint64_t> ns;
+    unsigned lost = 0;
+    uint64_t seq = 0;
+    while (ns.size() < opt.nr_samples && !st.failed) {
+        usleep(opt.gap_us);
+        st.sent_ns = now_ns();
+        __atomic_store_n(&st.seq, ++seq, __ATOMIC_RELEASE);
+        if (mode == mode_kick) {
+            vcpu.kick();
+        } else {
+            int err = pthread_kill(st.thread, kvm::vcpu::kick_signal());
+            if (err) {
+                throw errno_exception(err);
+            }
+        }
+        bool answered = false;
+        while (!st.failed && wait_exit(efd, opt.timeout_ms)) {
+            // skip a late answer to a kick that already timed out
+            if (__atomic_load_n(&st.echo, __ATOMIC_ACQUIRE) == seq) {
+                answered = true;
+                break;
+            }
+        }
+        if (st.failed) {
+            break;
+        }
+        if (!answered) {
+            ++lost;
+            continue;
+        }
+        ns.push_back(st.latency_ns);
+    }
+    // a plain signal could be lost here too; a failed runner has returned
+    __atomic_store_n(&st.done, true, __ATOMIC_RELEASE);
+    if (!st.failed) {
+        vcpu.kick();
+    }
+    thread.join();
+    if (st.failed) {
+        return false;
+    }
+
+    std::sort(ns.begin(), ns.end());
+    printf("%-8s %8u %6u %8llu %8llu %8llu %10llu\n", mode_names[mode],
+           unsigned(ns.size()), lost,
+           (unsigned long long)percentile(ns, 50),
+           (unsigned long long)percentile(ns, 90),
+           (unsigned long long)percentile(ns, 99),
+           (unsigned long long)ns.back());
+    return true;
+}
+
+int usage(const char* prog)
+{
+    fprintf(stderr, "usage: %s [-n samples] [-g gap us] [-t timeout ms]"
+            " [-m kick|signal] [-e]\n"
+            "          [-c runner host cpu] [-w kicker host cpu]\n",
+            prog);
+    return 2;
+}
+
+int test_main(int ac, char** av)
+{
+    bench_options opt;
+    int c;
+    while ((c = getopt(ac, av, "n:g:t:m:ec:w:")) != -1) {
+        switch (c) {
+        case 'n':
+            opt.nr_samples = strtoul(optarg, NULL, 0);
+            break;
+        case 'g':
+            opt.gap_us = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            opt.timeout_ms = strtoul(optarg, NULL, 0);
+            break;
+        case 'm':
+            opt.modes.clear();
+            if (!strcmp(optarg, "kick")) {
+                opt.modes.push_back(mode_kick);
+            } else if (!strcmp(optarg, "signal")) {
+                opt.modes.push_back(mode_signal);
+            } else {
+                return usage(av[0]);
+            }
+            break;
+        case 'e':
+            opt.exiting = true;
+            break;
+        case 'c':
+            opt.runner_cpu = atoi(optarg);
+            break;
+        case 'w':
+            opt.kicker_cpu = atoi(optarg);
+            break;
+        default:
+            return usage(av[0]);
+        }
+    }
+    if (!opt.nr_samples || !opt.timeout_ms) {
+        return usage(av[0]);
+    }
+
+    kvm::system sys;
+    size_t mem_size = 1 << 20;
+    char* mem = static_cast<char*>(::mmap(NULL, mem_size,
+                                          PROT_READ | PROT_WRITE,
+                                          MAP_PRIVATE | MAP_ANONYMOUS,
+                                          -1, 0));
+    if (mem == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    load_guest(mem, opt.exiting);
+    printf("%u kicks per mode, %u us apart, %s guest\n", opt.nr_samples,
+           opt.gap_us, opt.exiting ? "exiting" : "spinning");
+    printf("%-8s %8s %6s %8s %8s %8s %10s\n", "mode", "kicks", "lost",
+           "p50_ns", "p90_ns", "p99_ns", "max_ns");
+    for (unsigned i = 0; i < opt.modes.size(); ++i) {
+        if (!run_one(sys, opt, opt.modes[i], mem, mem_size)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
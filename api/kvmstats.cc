@@ -0,0 +1,161 @@
+
+#include "kvmstats.hh"
+#include "exception.hh"
+#include <unistd.h>
+#include <string.h>
+#include <algorithm>
+
+namespace kvm {
+
+namespace {
+
+void pread_all(int fd, void *buf, size_t len, off_t offset)
+{
+    char *p = static_cast<char *>(buf);
+    while (len) {
+        ssize_t r = ::pread(fd, p, len, offset);
+        if (r == -1 && errno == EINTR) {
+            continue;
+        }
+        if (r == -1) {
+            throw errno_exception(errno);
+        }
+        if (r == 0) {
+            throw errno_exception(EIO);
+        }
+        p += r;
+        len -= r;
+        offset += r;
+    }
+}
+
+std::string unit_name(const stats::descriptor& d)
+{
+    const char *unit = "";
+    switch (d.unit()) {
+    case KVM_STATS_UNIT_BYTES:
+        unit = "B";
+        break;
+    case KVM_STATS_UNIT_SECONDS:
+        unit = "s";
+        break;
+    case KVM_STATS_UNIT_CYCLES:
+        unit = "cycles";
+        break;
+    }
+    if (!d.exponent) {
+        return unit;
+    }
+    if ((d.flags & KVM_STATS_BASE_MASK) == KVM_STATS_BASE_POW10
+        && d.unit() == KVM_STATS_UNIT_SECONDS) {
+        switch (d.exponent) {
+        case -3: return "ms";
+        case -6: return "us";
+        case -9: return "ns";
+        }
+    }
+    char buf[32];
+    snprintf(buf, sizeof(buf), "x%d^%d %s",
+             (d.flags & KVM_STATS_BASE_MASK) == KVM_STATS_BASE_POW2 ? 2 : 10,
+             d.exponent, unit);
+    return buf;
+}
+
+}
+
+// Descriptors are name_size bytes longer than the struct, and the data
+// block holds each statistic's values at its offset.
+stats::stats(int fd)
+    : _fd(fd), _data_offset(0)
+{
+    kvm_stats_header hdr;
+    pread_all(_fd.get(), &hdr, sizeof(hdr), 0);
+    std::vector<char> id(hdr.name_size + 1);
+    pread_all(_fd.get(), &id[0], hdr.name_size, hdr.id_offset);
+    _id = &id[0];
+
+    size_t desc_size = sizeof(kvm_stats_desc) + hdr.name_size;
+    std::vector<char> descs(desc_size * hdr.num_desc);
+    if (!descs.empty()) {
+        pread_all(_fd.get(), &descs[0], descs.size(), hdr.desc_offset);
+    }
+    uint32_t data_size = 0;
+    for (unsigned i = 0; i < hdr.num_desc; ++i) {
+        const kvm_stats_desc *kd
+            = reinterpret_cast<const kvm_stats_desc *>(&descs[i * desc_size]);
+        descriptor d;
+        d.name.assign(kd->name, strnlen(kd->name, hdr.name_size));
+        d.flags = kd->flags;
+        d.exponent = kd->exponent;
+        d.size = kd->size;
+        d.index = kd->offset / sizeof(uint64_t);
+        d.bucket_size = kd->bucket_size;
+        _descs.push_back(d);
+        uint32_t end = kd->offset + kd->size * sizeof(uint64_t);
+        data_size = std::max(data_size, end);
+    }
+    _data_offset = hdr.data_offset;
+    _values.resize(data_size / sizeof(uint64_t));
+    sample();
+}
+
+int stats::find(const std::string& name) const
+{
+    for (unsigned i = 0; i < _descs.size(); ++i) {
+        if (_descs[i].name == name) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void stats::sample()
+{
+    if (!_values.empty()) {
+        pread_all(_fd.get(), &_values[0], _values.size() * sizeof(uint64_t),
+                  _data_offset);
+    }
+}
+
+stats_delta::stats_delta(stats& s)
+    : _stats(s), _before(s.values()), _after(s.values())
+{
+}
+
+void stats_delta::begin()
+{
+    _stats.sample();
+    _before = _stats.values();
+}
+
+void stats_delta::end()
+{
+    _stats.sample();
+    _after = _stats.values();
+}
+
+void stats_delta::print(FILE* f, bool all) const
+{
+    for (unsigned i = 0; i < _stats.size(); ++i) {
+        const stats::descriptor& d = _stats.desc(i);
+        int64_t v = 0;
+        bool changed = false;
+        for (unsigned j = d.index; j < d.index + d.size; ++j) {
+            changed |= _before[j] != _after[j];
+            v += _after[j] - _before[j];
+        }
+        if (d.type() == KVM_STATS_TYPE_INSTANT
+            || d.type() == KVM_STATS_TYPE_PEAK) {
+            v = _after[d.index];
+        }
+        if (!changed && !all) {
+            continue;
+        }
+        std::string unit = unit_name(d);
+        fprintf(f, "  %-36s %14lld%s%s%s\n", d.name.c_str(), (long long)v,
+                unit.empty() ? "" : " ", unit.c_str(),
+                d.size > 1 ? " (histogram)" : "");
+    }
+}
+
+}
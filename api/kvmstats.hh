@@ -0,0 +1,67 @@
+#ifndef API_KVMSTATS_HH
+#define API_KVMSTATS_HH
+
+#include "kvmxx.hh"
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+namespace kvm {
+
+// The binary statistics of a vm or vcpu, from KVM_GET_STATS_FD.  The
+// descriptors are read once; sample() refreshes every value with a single
+// pread into a buffer allocated up front, so it can run at high rates.
+class stats {
+public:
+    struct descriptor {
+        std::string name;
+        uint32_t flags;
+        int16_t exponent;
+        // values, and where the first one is in values()
+        uint16_t size;
+        uint32_t index;
+        uint32_t bucket_size;
+        uint32_t type() const { return flags & KVM_STATS_TYPE_MASK; }
+        uint32_t unit() const { return flags & KVM_STATS_UNIT_MASK; }
+    };
+public:
+    // takes ownership of the stats fd
+    explicit stats(int fd);
+    const std::string& id() const { return _id; }
+    unsigned size() const { return _descs.size(); }
+    const descriptor& desc(unsigned i) const { return _descs[i]; }
+    // the index of the named statistic, or -1
+    int find(const std::string& name) const;
+    void sample();
+    // the values read by the last sample(), in data block order
+    const std::vector<uint64_t>& values() const { return _values; }
+    uint64_t value(unsigned desc, unsigned item = 0) const {
+        return _values[_descs[desc].index + item];
+    }
+private:
+    fd _fd;
+    std::string _id;
+    std::vector<descriptor> _descs;
+    uint32_t _data_offset;
+    std::vector<uint64_t> _values;
+};
+
+// Samples a stats object around a measured region and prints what
+// changed: the difference for cumulative statistics and histograms
+// (summed over the buckets), the final value for instant and peak ones.
+class stats_delta {
+public:
+    explicit stats_delta(stats& s);
+    void begin();
+    void end();
+    // all == false skips statistics that did not change
+    void print(FILE* f, bool all = false) const;
+private:
+    stats& _stats;
+    std::vector<uint64_t> _before;
+    std::vector<uint64_t> _after;
+};
+
+}
+
+#endif
@@ -1,9 +1,12 @@
 #include "kvmxx.hh"
+#include "kvmstats.hh"
 #include "exception.hh"
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <stdlib.h>
+#include <time.h>
 #include <memory>
 #include <algorithm>
 
@@ -17,6 +20,28 @@ static long check_error(long r)
     return r;
 }
 
+template <typename T>
+static T value_or_throw(const result<T>& r)
+{
+    if (!r.ok()) {
+	throw errno_exception(r.error());
+    }
+    return *r;
+}
+
+static void check_result(const result<void>& r)
+{
+    if (!r.ok()) {
+	throw errno_exception(r.error());
+    }
+}
+
+template <typename T>
+static result<void> status(const result<T>& r)
+{
+    return r.ok() ? result<void>() : result<void>::failure(r.error());
+}
+
 fd::fd(int fd)
     : _fd(fd)
 {
@@ -34,16 +59,94 @@ fd::fd(std::string device_node, int flags)
     check_error(_fd);
 }
 
+result<long> fd::try_ioctl(unsigned nr, long arg)
+{
+    long r = ::ioctl(_fd, nr, arg);
+    if (r == -1) {
+	return result<long>::failure(errno);
+    }
+    return r;
+}
+
 long fd::ioctl(unsigned nr, long arg)
 {
-    return check_error(::ioctl(_fd, nr, arg));
+    return value_or_throw(try_ioctl(nr, arg));
+}
+
+eventfd::eventfd(unsigned initval, int flags)
+    : _fd(check_error(::eventfd(initval, flags)))
+{
+}
+
+uint64_t eventfd::read()
+{
+    uint64_t value;
+    if (::read(_fd.get(), &value, sizeof(value)) == -1) {
+	if (errno == EAGAIN) {
+	    return 0;
+	}
+	throw errno_exception(errno);
+    }
+    return value;
+}
+
+void eventfd::write(uint64_t value)
+{
+    check_error(::write(_fd.get(), &value, sizeof(value)));
+}
+
+static uint64_t monotonic_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// The kick only needs to interrupt the ioctl, so the handler does nothing;
+// without SA_RESTART the KVM_RUN it lands in returns EINTR.
+static void kick_handler(int sig)
+{
+}
+
+static pthread_once_t kick_handler_once = PTHREAD_ONCE_INIT;
+static int kick_handler_error;
+
+// A handler the embedder installed first is left alone; any handler
+// interrupts KVM_RUN as well, as long as the signal is not ignored.
+static void do_install_kick_handler()
+{
+    struct sigaction old;
+    if (sigaction(vcpu::kick_signal(), NULL, &old) == -1) {
+	kick_handler_error = errno;
+	return;
+    }
+    if ((old.sa_flags & SA_SIGINFO) || old.sa_handler != SIG_DFL) {
+	return;
+    }
+    struct sigaction sa = {};
+    sa.sa_handler = kick_handler;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(vcpu::kick_signal(), &sa, NULL) == -1) {
+	kick_handler_error = errno;
+    }
+}
+
+static void install_kick_handler()
+{
+    pthread_once(&kick_handler_once, do_install_kick_handler);
+    if (kick_handler_error) {
+	throw errno_exception(kick_handler_error);
+    }
 }
 
 vcpu::vcpu(vm& vm, int id)
     : _vm(vm), _fd(vm._fd.ioctl(KVM_CREATE_VCPU, id)), _shared(NULL)
     , _mmap_size(_vm._system._fd.ioctl(KVM_GET_VCPU_MMAP_SIZE, 0))
-
+    , _dirty_gfns(NULL), _nr_dirty_gfns(0), _dirty_gfn_fetch(0)
+    , _coalesced(NULL), _sync_regs(0), _sync_valid(0)
+    , _has_thread(false), _kick_time(0), _kick_latency(0)
 {
+    install_kick_handler();
     kvm_run *shared = static_cast<kvm_run*>(::mmap(NULL, _mmap_size,
 						   PROT_READ | PROT_WRITE,
 						   MAP_SHARED,
@@ -52,40 +155,256 @@ vcpu::vcpu(vm& vm, int id)
 	throw errno_exception(errno);
     }
     _shared = shared;
+    int coalesced_page = _vm._system.get_extension_int(KVM_CAP_COALESCED_MMIO);
+    if (coalesced_page) {
+	_coalesced = reinterpret_cast<kvm_coalesced_mmio_ring*>(
+	    reinterpret_cast<char*>(_shared)
+	    + coalesced_page * ::getpagesize());
+    }
+    if (_vm._dirty_ring_size) {
+	void *ring = ::mmap(NULL, _vm._dirty_ring_size,
+			    PROT_READ | PROT_WRITE, MAP_SHARED, _fd.get(),
+			    KVM_DIRTY_LOG_PAGE_OFFSET * ::getpagesize());
+	if (ring == MAP_FAILED) {
+	    int err = errno;
+	    munmap(_shared, _mmap_size);
+	    throw errno_exception(err);
+	}
+	_dirty_gfns = static_cast<kvm_dirty_gfn*>(ring);
+	_nr_dirty_gfns = _vm._dirty_ring_size / sizeof(kvm_dirty_gfn);
+    }
 }
 
 vcpu::~vcpu()
 {
+    if (_dirty_gfns) {
+	munmap(_dirty_gfns, _vm._dirty_ring_size);
+    }
     munmap(_shared, _mmap_size);
 }
 
+int vcpu::kick_signal()
+{
+    return SIGRTMIN;
+}
+
+void vcpu::kick()
+{
+    __atomic_store_n(&_kick_time, monotonic_ns(), __ATOMIC_RELAXED);
+    __atomic_store_n(&_shared->immediate_exit, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&_has_thread, __ATOMIC_ACQUIRE)) {
+	int err = pthread_kill(_thread, kick_signal());
+	if (err) {
+	    throw errno_exception(err);
+	}
+    }
+}
+
+// With sync regs, KVM_RUN loads the state marked in kvm_dirty_regs on
+// entry and stores everything in kvm_valid_regs on exit, so reads after an
+// exit and writes before the next entry need no ioctl.
+result<void> vcpu::try_run()
+{
+    if (!_has_thread || !pthread_equal(_thread, pthread_self())) {
+	_thread = pthread_self();
+	__atomic_store_n(&_has_thread, true, __ATOMIC_RELEASE);
+    }
+    if (_sync_regs) {
+	_shared->kvm_valid_regs = _sync_regs;
+    }
+    result<long> r = _fd.try_ioctl(KVM_RUN, 0);
+    if (!r.ok()) {
+	// only our own pending writes are still known to be current
+	_sync_valid &= _shared->kvm_dirty_regs;
+	if (r.error() == EINTR && _shared->immediate_exit) {
+	    // consumed only here: a kick after a normal exit must still
+	    // stop the next KVM_RUN
+	    _shared->immediate_exit = 0;
+	    uint64_t kicked = __atomic_exchange_n(&_kick_time, 0,
+						  __ATOMIC_RELAXED);
+	    if (kicked) {
+		_kick_latency = monotonic_ns() - kicked;
+	    }
+	}
+	return status(r);
+    }
+    _sync_valid = _sync_regs;
+    return result<void>();
+}
+
 void vcpu::run()
 {
-    _fd.ioctl(KVM_RUN, 0);
+    check_result(try_run());
 }
 
-kvm_regs vcpu::regs()
+kvm_run *vcpu::shared()
 {
+    return _shared;
+}
+
+uint64_t vcpu::enable_sync_regs()
+{
+    const uint64_t wanted = KVM_SYNC_X86_REGS | KVM_SYNC_X86_SREGS
+	| KVM_SYNC_X86_EVENTS;
+    _sync_regs = _vm._system.get_extension_int(KVM_CAP_SYNC_REGS) & wanted;
+    _sync_valid = 0;
+    return _sync_regs;
+}
+
+result<kvm_regs> vcpu::try_regs()
+{
+    if (_sync_valid & KVM_SYNC_X86_REGS) {
+	return _shared->s.regs.regs;
+    }
     kvm_regs regs;
-    _fd.ioctlp(KVM_GET_REGS, &regs);
+    result<long> r = _fd.try_ioctlp(KVM_GET_REGS, &regs);
+    if (!r.ok()) {
+	return result<kvm_regs>::failure(r.error());
+    }
     return regs;
 }
 
+kvm_regs vcpu::regs()
+{
+    return value_or_throw(try_regs());
+}
+
+result<void> vcpu::try_set_regs(const kvm_regs& regs)
+{
+    if (_sync_regs & KVM_SYNC_X86_REGS) {
+	_shared->s.regs.regs = regs;
+	_shared->kvm_dirty_regs |= KVM_SYNC_X86_REGS;
+	_sync_valid |= KVM_SYNC_X86_REGS;
+	return result<void>();
+    }
+    return status(_fd.try_ioctlp(KVM_SET_REGS, const_cast<kvm_regs*>(&regs)));
+}
+
 void vcpu::set_regs(const kvm_regs& regs)
 {
-    _fd.ioctlp(KVM_SET_REGS, const_cast<kvm_regs*>(&regs));
+    check_result(try_set_regs(regs));
 }
 
-kvm_sregs vcpu::sregs()
+result<kvm_sregs> vcpu::try_sregs()
 {
+    if (_sync_valid & KVM_SYNC_X86_SREGS) {
+	return _shared->s.regs.sregs;
+    }
     kvm_sregs sregs;
-    _fd.ioctlp(KVM_GET_SREGS, &sregs);
+    result<long> r = _fd.try_ioctlp(KVM_GET_SREGS, &sregs);
+    if (!r.ok()) {
+	return result<kvm_sregs>::failure(r.error());
+    }
     return sregs;
 }
 
+kvm_sregs vcpu::sregs()
+{
+    return value_or_throw(try_sregs());
+}
+
+result<void> vcpu::try_set_sregs(const kvm_sregs& sregs)
+{
+    if (_sync_regs & KVM_SYNC_X86_SREGS) {
+	_shared->s.regs.sregs = sregs;
+	_shared->kvm_dirty_regs |= KVM_SYNC_X86_SREGS;
+	_sync_valid |= KVM_SYNC_X86_SREGS;
+	return result<void>();
+    }
+    return status(_fd.try_ioctlp(KVM_SET_SREGS,
+				 const_cast<kvm_sregs*>(&sregs)));
+}
+
 void vcpu::set_sregs(const kvm_sregs& sregs)
 {
-    _fd.ioctlp(KVM_SET_SREGS, const_cast<kvm_sregs*>(&sregs));
+    check_result(try_set_sregs(sregs));
+}
+
+result<kvm_fpu> vcpu::try_fpu()
+{
+    kvm_fpu fpu;
+    result<long> r = _fd.try_ioctlp(KVM_GET_FPU, &fpu);
+    if (!r.ok()) {
+	return result<kvm_fpu>::failure(r.error());
+    }
+    return fpu;
+}
+
+kvm_fpu vcpu::fpu()
+{
+    return value_or_throw(try_fpu());
+}
+
+result<void> vcpu::try_set_fpu(const kvm_fpu& fpu)
+{
+    return status(_fd.try_ioctlp(KVM_SET_FPU, const_cast<kvm_fpu*>(&fpu)));
+}
+
+void vcpu::set_fpu(const kvm_fpu& fpu)
+{
+    check_result(try_set_fpu(fpu));
+}
+
+result<kvm_vcpu_events> vcpu::try_events()
+{
+    if (_sync_valid & KVM_SYNC_X86_EVENTS) {
+	return _shared->s.regs.events;
+    }
+    kvm_vcpu_events events;
+    result<long> r = _fd.try_ioctlp(KVM_GET_VCPU_EVENTS, &events);
+    if (!r.ok()) {
+	return result<kvm_vcpu_events>::failure(r.error());
+    }
+    return events;
+}
+
+kvm_vcpu_events vcpu::events()
+{
+    return value_or_throw(try_events());
+}
+
+result<void> vcpu::try_set_events(const kvm_vcpu_events& events)
+{
+    if (_sync_regs & KVM_SYNC_X86_EVENTS) {
+	_shared->s.regs.events = events;
+	_shared->kvm_dirty_regs |= KVM_SYNC_X86_EVENTS;
+	_sync_valid |= KVM_SYNC_X86_EVENTS;
+	return result<void>();
+    }
+    return status(_fd.try_ioctlp(KVM_SET_VCPU_EVENTS,
+				 const_cast<kvm_vcpu_events*>(&events)));
+}
+
+void vcpu::set_events(const kvm_vcpu_events& events)
+{
+    check_result(try_set_events(events));
+}
+
+result<uint32_t> vcpu::try_mp_state()
+{
+    kvm_mp_state mp;
+    result<long> r = _fd.try_ioctlp(KVM_GET_MP_STATE, &mp);
+    if (!r.ok()) {
+	return result<uint32_t>::failure(r.error());
+    }
+    return mp.mp_state;
+}
+
+uint32_t vcpu::mp_state()
+{
+    return value_or_throw(try_mp_state());
+}
+
+result<void> vcpu::try_set_mp_state(uint32_t state)
+{
+    kvm_mp_state mp;
+    mp.mp_state = state;
+    return status(_fd.try_ioctlp(KVM_SET_MP_STATE, &mp));
+}
+
+void vcpu::set_mp_state(uint32_t state)
+{
+    check_result(try_set_mp_state(state));
 }
 
 class vcpu::kvm_msrs_ptr {
@@ -108,7 +427,7 @@ vcpu::kvm_msrs_ptr::kvm_msrs_ptr(size_t nmsrs)
     }
 }
 
-std::vector<kvm_msr_entry> vcpu::msrs(std::vector<uint32_t> indices)
+std::vector<kvm_msr_entry> vcpu::msrs(const std::vector<uint32_t>& indices)
 {
     kvm_msrs_ptr msrs(indices.size());
     msrs->nmsrs = indices.size();
@@ -128,6 +447,85 @@ void vcpu::set_msrs(const std::vector<kvm_msr_entry>& msrs)
     _fd.ioctlp(KVM_SET_MSRS, _msrs.get());
 }
 
+result<unsigned> vcpu::try_get_msrs(kvm_msrs *msrs)
+{
+    result<long> r = _fd.try_ioctlp(KVM_GET_MSRS, msrs);
+    if (!r.ok()) {
+	return result<unsigned>::failure(r.error());
+    }
+    return unsigned(*r);
+}
+
+unsigned vcpu::get_msrs(kvm_msrs *msrs)
+{
+    return value_or_throw(try_get_msrs(msrs));
+}
+
+result<unsigned> vcpu::try_set_msrs(const kvm_msrs *msrs)
+{
+    result<long> r = _fd.try_ioctlp(KVM_SET_MSRS, const_cast<kvm_msrs*>(msrs));
+    if (!r.ok()) {
+	return result<unsigned>::failure(r.error());
+    }
+    return unsigned(*r);
+}
+
+unsigned vcpu::set_msrs(const kvm_msrs *msrs)
+{
+    return value_or_throw(try_set_msrs(msrs));
+}
+
+// The span variants go through an on-stack batch, a chunk at a time.
+static const unsigned msr_chunk = 64;
+
+unsigned vcpu::get_msrs(const uint32_t *indices, uint64_t *values, unsigned n)
+{
+    msr_batch<msr_chunk> batch;
+    unsigned done = 0;
+    while (done < n) {
+	batch.clear();
+	for (unsigned i = done; i < n && !batch.full(); ++i) {
+	    batch.add(indices[i]);
+	}
+	unsigned nr = get_msrs(batch);
+	for (unsigned i = 0; i < nr; ++i) {
+	    values[done + i] = batch[i].data;
+	}
+	done += nr;
+	if (nr < batch.size()) {
+	    break;
+	}
+    }
+    return done;
+}
+
+unsigned vcpu::set_msrs(const uint32_t *indices, const uint64_t *values,
+			unsigned n)
+{
+    msr_batch<msr_chunk> batch;
+    unsigned done = 0;
+    while (done < n) {
+	batch.clear();
+	for (unsigned i = done; i < n && !batch.full(); ++i) {
+	    batch.add(indices[i], values[i]);
+	}
+	unsigned nr = set_msrs(batch);
+	done += nr;
+	if (nr < batch.size()) {
+	    break;
+	}
+    }
+    return done;
+}
+
+kvm::stats& vcpu::stats()
+{
+    if (!_stats) {
+	_stats.reset(new kvm::stats(_fd.ioctl(KVM_GET_STATS_FD, 0)));
+    }
+    return *_stats;
+}
+
 void vcpu::set_debug(uint64_t dr[8], bool enabled, bool singlestep)
 {
     kvm_guest_debug gd;
@@ -145,9 +543,44 @@ void vcpu::set_debug(uint64_t dr[8], bool enabled, bool singlestep)
     _fd.ioctlp(KVM_SET_GUEST_DEBUG, &gd);
 }
 
+// Collects the entries the kernel has published since the last call and
+// hands them back to it; the pages are write-protected again only once
+// vm::reset_dirty_rings() is called.
+unsigned vcpu::harvest_dirty_ring(std::vector<kvm_dirty_gfn>& gfns)
+{
+    unsigned nr = 0;
+    while (_nr_dirty_gfns) {
+	volatile kvm_dirty_gfn *gfn
+	    = &_dirty_gfns[_dirty_gfn_fetch & (_nr_dirty_gfns - 1)];
+	if (!(gfn->flags & KVM_DIRTY_GFN_F_DIRTY)) {
+	    break;
+	}
+	__sync_synchronize();
+	kvm_dirty_gfn entry;
+	entry.flags = gfn->flags;
+	entry.slot = gfn->slot;
+	entry.offset = gfn->offset;
+	gfns.push_back(entry);
+	__sync_synchronize();
+	gfn->flags = KVM_DIRTY_GFN_F_RESET;
+	++_dirty_gfn_fetch;
+	++nr;
+    }
+    return nr;
+}
+
 vm::vm(system& system)
     : _system(system), _fd(system._fd.ioctl(KVM_CREATE_VM, 0))
+    , _dirty_ring_size(0), _manual_dirty_log_protect(false)
+{
+}
+
+kvm::stats& vm::stats()
 {
+    if (!_stats) {
+	_stats.reset(new kvm::stats(_fd.ioctl(KVM_GET_STATS_FD, 0)));
+    }
+    return *_stats;
 }
 
 void vm::set_memory_region(int slot, void *addr, uint64_t gpa, size_t len,
@@ -171,16 +604,296 @@ void vm::get_dirty_log(int slot, void *log)
     _fd.ioctlp(KVM_GET_DIRTY_LOG, &kdl);
 }
 
+// With manual protection KVM_GET_DIRTY_LOG only reports pages; they are
+// write-protected again by clear_dirty_log().
+void vm::enable_manual_dirty_log_protect(bool initially_set)
+{
+    uint64_t flags = KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE;
+    if (initially_set) {
+	flags |= KVM_DIRTY_LOG_INITIALLY_SET;
+    }
+    enable_cap(KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2, flags);
+    _manual_dirty_log_protect = true;
+}
+
+// first_page must be a multiple of 64, as must nr_pages unless the range
+// ends at the end of the slot.  log holds the bit for first_page in bit 0.
+void vm::clear_dirty_log(int slot, void *log, uint64_t first_page,
+                         uint32_t nr_pages)
+{
+    struct kvm_clear_dirty_log kcdl = {};
+    kcdl.slot = slot;
+    kcdl.num_pages = nr_pages;
+    kcdl.first_page = first_page;
+    kcdl.dirty_bitmap = log;
+    _fd.ioctlp(KVM_CLEAR_DIRTY_LOG, &kcdl);
+}
+
+void vm::create_irqchip()
+{
+    _fd.ioctl(KVM_CREATE_IRQCHIP, 0);
+}
+
+void vm::add_coalesced_mmio(uint64_t addr, uint32_t size, bool pio)
+{
+    kvm_coalesced_mmio_zone zone = {};
+    zone.addr = addr;
+    zone.size = size;
+    zone.pio = pio;
+    _fd.ioctlp(KVM_REGISTER_COALESCED_MMIO, &zone);
+}
+
+void vm::remove_coalesced_mmio(uint64_t addr, uint32_t size, bool pio)
+{
+    kvm_coalesced_mmio_zone zone = {};
+    zone.addr = addr;
+    zone.size = size;
+    zone.pio = pio;
+    _fd.ioctlp(KVM_UNREGISTER_COALESCED_MMIO, &zone);
+}
+
+static void ioeventfd(fd& vmfd, int efd, uint64_t addr, uint32_t len,
+		      uint32_t flags)
+{
+    kvm_ioeventfd kie = {};
+    kie.addr = addr;
+    kie.len = len;
+    kie.fd = efd;
+    kie.flags = flags;
+    vmfd.ioctlp(KVM_IOEVENTFD, &kie);
+}
+
+void vm::add_ioeventfd(int efd, uint64_t addr, uint32_t len, bool pio)
+{
+    ioeventfd(_fd, efd, addr, len, pio ? KVM_IOEVENTFD_FLAG_PIO : 0);
+}
+
+void vm::remove_ioeventfd(int efd, uint64_t addr, uint32_t len, bool pio)
+{
+    ioeventfd(_fd, efd, addr, len,
+	      KVM_IOEVENTFD_FLAG_DEASSIGN
+	      | (pio ? KVM_IOEVENTFD_FLAG_PIO : 0));
+}
+
+void vm::add_irqfd(int efd, uint32_t gsi)
+{
+    kvm_irqfd kif = {};
+    kif.fd = efd;
+    kif.gsi = gsi;
+    _fd.ioctlp(KVM_IRQFD, &kif);
+}
+
+void vm::remove_irqfd(int efd, uint32_t gsi)
+{
+    kvm_irqfd kif = {};
+    kif.fd = efd;
+    kif.gsi = gsi;
+    kif.flags = KVM_IRQFD_FLAG_DEASSIGN;
+    _fd.ioctlp(KVM_IRQFD, &kif);
+}
+
+void vm::enable_cap(uint32_t cap, uint64_t arg)
+{
+    kvm_enable_cap ec = {};
+    ec.cap = cap;
+    ec.args[0] = arg;
+    _fd.ioctlp(KVM_ENABLE_CAP, &ec);
+}
+
+// Must be called before any vcpu is created; size is in bytes and must be
+// a power of two no larger than KVM_CAP_DIRTY_LOG_RING reports.
+void vm::enable_dirty_ring(uint32_t size)
+{
+    enable_cap(KVM_CAP_DIRTY_LOG_RING, size);
+    _dirty_ring_size = size;
+}
+
+void vm::reset_dirty_rings()
+{
+    _fd.ioctl(KVM_RESET_DIRTY_RINGS, 0);
+}
+
 void vm::set_tss_addr(uint32_t addr)
 {
     _fd.ioctl(KVM_SET_TSS_ADDR, addr);
 }
 
+static run_loop::action resume_interrupted(kvm_run *run)
+{
+    return run_loop::resume;
+}
+
+run_loop::run_loop(vcpu& vcpu)
+    : _vcpu(vcpu), _pio_index(65536), _pio_handlers(1), _nr_exits(0)
+{
+    set_handler(KVM_EXIT_INTR, resume_interrupted);
+}
+
+// Index 0 of _pio_handlers is unused so that a zero _pio_index entry
+// means the port has no handler.
+void run_loop::add_pio(uint16_t port, unsigned nr_ports, pio_handler handler)
+{
+    if (port + nr_ports > _pio_index.size()) {
+	throw errno_exception(EINVAL);
+    }
+    uint16_t index = _pio_handlers.size();
+    _pio_handlers.push_back(handler);
+    for (unsigned i = port; i < port + nr_ports; ++i) {
+	_pio_index[i] = index;
+    }
+}
+
+void run_loop::add_mmio(uint64_t gpa, uint64_t len, mmio_handler handler)
+{
+    mmio_range range;
+    range.gpa = gpa;
+    range.len = len;
+    range.handler = handler;
+    std::vector<mmio_range>::iterator i
+	= std::upper_bound(_mmio.begin(), _mmio.end(), range);
+    if ((i != _mmio.end() && i->gpa < gpa + len)
+	|| (i != _mmio.begin() && (i - 1)->gpa + (i - 1)->len > gpa)) {
+	throw errno_exception(EEXIST);
+    }
+    _mmio.insert(i, range);
+}
+
+void run_loop::set_handler(uint32_t exit_reason, exit_handler handler)
+{
+    if (exit_reason >= _handlers.size()) {
+	_handlers.resize(exit_reason + 1);
+    }
+    _handlers[exit_reason] = handler;
+}
+
+uint32_t run_loop::run()
+{
+    kvm_run *run = _vcpu.shared();
+    action next;
+    do {
+	result<void> r = _vcpu.try_run();
+	if (!r.ok()) {
+	    if (r.error() != EINTR && r.error() != EAGAIN) {
+		throw errno_exception(r.error());
+	    }
+	    run->exit_reason = KVM_EXIT_INTR;
+	}
+	++_nr_exits;
+	// queued writes happened before the exit, so they go first
+	next = dispatch_coalesced();
+	if (dispatch(run) == stop) {
+	    next = stop;
+	}
+    } while (next == resume);
+    return run->exit_reason;
+}
+
+// The coalesced ring is shared by all vcpus of the vm, so entries are
+// claimed with a cmpxchg on the consumer index after copying them out.
+run_loop::action run_loop::dispatch_coalesced()
+{
+    kvm_coalesced_mmio_ring *ring = _vcpu.coalesced_mmio_ring();
+    action ret = resume;
+    if (!ring) {
+	return ret;
+    }
+    const uint32_t nr_entries = (::getpagesize() - sizeof(*ring))
+	/ sizeof(kvm_coalesced_mmio);
+    for (;;) {
+	uint32_t first = *static_cast<volatile uint32_t *>(&ring->first);
+	if (first == *static_cast<volatile uint32_t *>(&ring->last)) {
+	    return ret;
+	}
+	__sync_synchronize();
+	kvm_coalesced_mmio entry = ring->coalesced_mmio[first];
+	if (!__sync_bool_compare_and_swap(&ring->first, first,
+					  (first + 1) % nr_entries)) {
+	    continue;
+	}
+	action a = stop;
+	if (entry.pio) {
+	    uint16_t index = _pio_index[entry.phys_addr & 0xffff];
+	    if (index) {
+		a = _pio_handlers[index](entry.phys_addr, true, entry.data,
+					 entry.len, 1);
+	    }
+	} else if (mmio_handler *handler = find_mmio(entry.phys_addr)) {
+	    a = (*handler)(entry.phys_addr, true, entry.data, entry.len);
+	}
+	if (a == stop) {
+	    ret = stop;
+	}
+    }
+}
+
+// Exits nobody handles stop the loop, so that the caller sees them.
+run_loop::action run_loop::dispatch(kvm_run *run)
+{
+    switch (run->exit_reason) {
+    case KVM_EXIT_IO:
+	return dispatch_pio(run);
+    case KVM_EXIT_MMIO:
+	return dispatch_mmio(run);
+    }
+    if (run->exit_reason < _handlers.size() && _handlers[run->exit_reason]) {
+	return _handlers[run->exit_reason](run);
+    }
+    return stop;
+}
+
+run_loop::action run_loop::dispatch_pio(kvm_run *run)
+{
+    uint16_t index = _pio_index[run->io.port];
+    if (!index) {
+	return stop;
+    }
+    void *data = reinterpret_cast<char *>(run) + run->io.data_offset;
+    return _pio_handlers[index](run->io.port,
+				run->io.direction == KVM_EXIT_IO_OUT,
+				data, run->io.size, run->io.count);
+}
+
+run_loop::mmio_handler *run_loop::find_mmio(uint64_t gpa)
+{
+    mmio_range key;
+    key.gpa = gpa;
+    std::vector<mmio_range>::iterator i
+	= std::upper_bound(_mmio.begin(), _mmio.end(), key);
+    if (i == _mmio.begin()) {
+	return NULL;
+    }
+    --i;
+    if (i->gpa + i->len <= gpa) {
+	return NULL;
+    }
+    return &i->handler;
+}
+
+run_loop::action run_loop::dispatch_mmio(kvm_run *run)
+{
+    mmio_handler *handler = find_mmio(run->mmio.phys_addr);
+    if (!handler) {
+	return stop;
+    }
+    return (*handler)(run->mmio.phys_addr, run->mmio.is_write,
+		      run->mmio.data, run->mmio.len);
+}
+
 system::system(std::string device_node)
     : _fd(device_node, O_RDWR)
 {
 }
 
+std::vector<uint32_t> system::msr_index_list()
+{
+    const unsigned max_msrs = 4096;
+    std::vector<uint32_t> buf(1 + max_msrs);
+    kvm_msr_list *list = reinterpret_cast<kvm_msr_list*>(&buf[0]);
+    list->nmsrs = max_msrs;
+    _fd.ioctlp(KVM_GET_MSR_INDEX_LIST, list);
+    return std::vector<uint32_t>(list->indices, list->indices + list->nmsrs);
+}
+
 bool system::check_extension(int extension)
 {
     return _fd.ioctl(KVM_CHECK_EXTENSION, extension);
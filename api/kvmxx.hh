@@ -3,11 +3,14 @@
 
 #include <string>
 #include <signal.h>
+#include <pthread.h>
 #include <unistd.h>
 #include <vector>
 #include <errno.h>
 #include <linux/kvm.h>
 #include <stdint.h>
+#include <tr1/functional>
+#include <tr1/memory>
 
 namespace kvm {
 
@@ -15,6 +18,48 @@ class system;
 class vm;
 class vcpu;
 class fd;
+class stats;
+
+// A value, or the errno of the call that failed to produce it.  The try_
+// calls return these instead of throwing errno_exception, for paths where
+// failures such as EINTR are expected and for code built without
+// exceptions; the throwing calls are built on them.
+template <typename T>
+class result {
+public:
+    result(const T& value) : _value(value), _error(0) {}
+    static result failure(int error) {
+	result r;
+	r._error = error;
+	return r;
+    }
+    bool ok() const { return !_error; }
+    int error() const { return _error; }
+    // only meaningful if ok()
+    T& operator*() { return _value; }
+    const T& operator*() const { return _value; }
+    const T* operator->() const { return &_value; }
+private:
+    result() : _value(), _error(0) {}
+private:
+    T _value;
+    int _error;
+};
+
+template <>
+class result<void> {
+public:
+    result() : _error(0) {}
+    static result failure(int error) {
+	result r;
+	r._error = error;
+	return r;
+    }
+    bool ok() const { return !_error; }
+    int error() const { return _error; }
+private:
+    int _error;
+};
 
 class fd {
 public:
@@ -27,10 +72,61 @@ public:
     long ioctlp(unsigned nr, void *arg) {
 	return ioctl(nr, reinterpret_cast<long>(arg));
     }
+    result<long> try_ioctl(unsigned nr, long arg);
+    result<long> try_ioctlp(unsigned nr, void *arg) {
+	return try_ioctl(nr, reinterpret_cast<long>(arg));
+    }
 private:
     int _fd;
 };
 
+// An eventfd(2), for use with ioeventfds and irqfds.
+class eventfd {
+public:
+    explicit eventfd(unsigned initval = 0, int flags = 0);
+    int get() { return _fd.get(); }
+    // returns the counter and resets it, blocking while it is zero unless
+    // the eventfd was created with EFD_NONBLOCK, in which case it returns 0
+    uint64_t read();
+    void write(uint64_t value = 1);
+private:
+    fd _fd;
+};
+
+// A KVM_GET/SET_MSRS argument with room for capacity entries in place,
+// so that it can be filled and reused without allocating.
+template <unsigned capacity>
+class msr_batch {
+public:
+    msr_batch() { clear(); }
+    void clear() { get()->nmsrs = 0; }
+    unsigned size() const { return get()->nmsrs; }
+    bool full() const { return size() == capacity; }
+    void resize(unsigned n) { get()->nmsrs = n; }
+    // returns false if the batch is full
+    bool add(uint32_t index, uint64_t data = 0) {
+	if (full()) {
+	    return false;
+	}
+	kvm_msr_entry& e = get()->entries[get()->nmsrs++];
+	e.index = index;
+	e.reserved = 0;
+	e.data = data;
+	return true;
+    }
+    kvm_msr_entry& operator[](unsigned i) { return get()->entries[i]; }
+    const kvm_msr_entry& operator[](unsigned i) const {
+	return get()->entries[i];
+    }
+    kvm_msrs *get() { return reinterpret_cast<kvm_msrs*>(_buf); }
+    const kvm_msrs *get() const {
+	return reinterpret_cast<const kvm_msrs*>(_buf);
+    }
+private:
+    uint64_t _buf[(sizeof(kvm_msrs) + capacity * sizeof(kvm_msr_entry)
+                   + sizeof(uint64_t) - 1) / sizeof(uint64_t)];
+};
+
 class vcpu {
 public:
     vcpu(vm& vm, int fd);
@@ -41,9 +137,66 @@ public:
     void set_regs(const kvm_regs& regs);
     kvm_sregs sregs();
     void set_sregs(const kvm_sregs& sregs);
-    std::vector<kvm_msr_entry> msrs(std::vector<uint32_t> indices);
+    kvm_fpu fpu();
+    void set_fpu(const kvm_fpu& fpu);
+    kvm_vcpu_events events();
+    void set_events(const kvm_vcpu_events& events);
+    // KVM_MP_STATE_*; with an in-kernel irqchip, vcpus other than the
+    // first start out waiting for INIT/SIPI
+    uint32_t mp_state();
+    void set_mp_state(uint32_t state);
+    // Non-throwing variants.  try_run() fails with EINTR when a signal or
+    // immediate_exit interrupts KVM_RUN.
+    result<void> try_run();
+    result<kvm_regs> try_regs();
+    result<void> try_set_regs(const kvm_regs& regs);
+    result<kvm_sregs> try_sregs();
+    result<void> try_set_sregs(const kvm_sregs& sregs);
+    result<kvm_fpu> try_fpu();
+    result<void> try_set_fpu(const kvm_fpu& fpu);
+    result<kvm_vcpu_events> try_events();
+    result<void> try_set_events(const kvm_vcpu_events& events);
+    result<uint32_t> try_mp_state();
+    result<void> try_set_mp_state(uint32_t state);
+    result<unsigned> try_get_msrs(kvm_msrs *msrs);
+    result<unsigned> try_set_msrs(const kvm_msrs *msrs);
+    // Access regs, sregs and events through kvm_run where KVM_CAP_SYNC_REGS
+    // allows; returns the KVM_SYNC_X86_* mask in use (0: ioctls only).
+    uint64_t enable_sync_regs();
+    std::vector<kvm_msr_entry> msrs(const std::vector<uint32_t>& indices);
     void set_msrs(const std::vector<kvm_msr_entry>& msrs);
+    // Allocation-free variants.  They return the number of msrs accessed,
+    // which is short of the requested count if an msr was refused.
+    template <unsigned capacity>
+    unsigned get_msrs(msr_batch<capacity>& batch) {
+	return get_msrs(batch.get());
+    }
+    template <unsigned capacity>
+    unsigned set_msrs(const msr_batch<capacity>& batch) {
+	return set_msrs(batch.get());
+    }
+    unsigned get_msrs(const uint32_t *indices, uint64_t *values, unsigned n);
+    unsigned set_msrs(const uint32_t *indices, const uint64_t *values,
+                      unsigned n);
+    unsigned get_msrs(kvm_msrs *msrs);
+    unsigned set_msrs(const kvm_msrs *msrs);
     void set_debug(uint64_t dr[8], bool enabled, bool singlestep);
+    unsigned harvest_dirty_ring(std::vector<kvm_dirty_gfn>& gfns);
+    kvm_coalesced_mmio_ring *coalesced_mmio_ring() { return _coalesced; }
+    // binary statistics, opened on first use (see kvmstats.hh)
+    kvm::stats& stats();
+    // Makes the current or next KVM_RUN of this vcpu return EINTR, from
+    // any thread.  Sets immediate_exit, so a kick that lands while the
+    // vcpu thread is outside KVM_RUN is not lost, and sends kick_signal()
+    // to the thread that last ran the vcpu to force it out of the guest.
+    // That thread must still be alive.
+    void kick();
+    // ns from the kick() to the exit it caused, for the last such exit
+    uint64_t kick_latency() const { return _kick_latency; }
+    // SIGRTMIN.  The library takes the signal over: the first vcpu
+    // constructed installs an empty handler for it, unless the process
+    // already has one, which then also serves kicks.  Don't ignore it.
+    static int kick_signal();
 private:
     class kvm_msrs_ptr;
 private:
@@ -51,6 +204,17 @@ private:
     fd _fd;
     kvm_run *_shared;
     unsigned _mmap_size;
+    kvm_dirty_gfn *_dirty_gfns;
+    uint32_t _nr_dirty_gfns;
+    uint32_t _dirty_gfn_fetch;
+    kvm_coalesced_mmio_ring *_coalesced;
+    uint64_t _sync_regs;
+    uint64_t _sync_valid;
+    std::tr1::shared_ptr<kvm::stats> _stats;
+    pthread_t _thread;
+    bool _has_thread;
+    uint64_t _kick_time;
+    uint64_t _kick_latency;
     friend class vm;
 };
 
@@ -60,20 +224,93 @@ public:
     void set_memory_region(int slot, void *addr, uint64_t gpa, size_t len,
                            uint32_t flags = 0);
     void get_dirty_log(int slot, void *log);
+    void enable_manual_dirty_log_protect(bool initially_set = false);
+    bool manual_dirty_log_protect() const { return _manual_dirty_log_protect; }
+    void clear_dirty_log(int slot, void *log, uint64_t first_page,
+                         uint32_t nr_pages);
+    void enable_cap(uint32_t cap, uint64_t arg = 0);
+    void enable_dirty_ring(uint32_t size);
+    uint32_t dirty_ring_size() const { return _dirty_ring_size; }
+    void reset_dirty_rings();
     void set_tss_addr(uint32_t addr);
+    void create_irqchip();
+    // writes to a coalesced zone are queued in each vcpu's coalesced mmio
+    // ring instead of exiting; run_loop drains the ring after every exit
+    void add_coalesced_mmio(uint64_t addr, uint32_t size, bool pio = false);
+    void remove_coalesced_mmio(uint64_t addr, uint32_t size,
+                               bool pio = false);
+    // len 0 matches writes of any size
+    void add_ioeventfd(int efd, uint64_t addr, uint32_t len,
+                       bool pio = false);
+    void remove_ioeventfd(int efd, uint64_t addr, uint32_t len,
+                          bool pio = false);
+    void add_irqfd(int efd, uint32_t gsi);
+    void remove_irqfd(int efd, uint32_t gsi);
+    // binary statistics, opened on first use (see kvmstats.hh)
+    kvm::stats& stats();
     system& sys() { return _system; }
 private:
     system& _system;
     fd _fd;
+    uint32_t _dirty_ring_size;
+    bool _manual_dirty_log_protect;
+    std::tr1::shared_ptr<kvm::stats> _stats;
     friend class system;
     friend class vcpu;
 };
 
+// Runs a vcpu until a handler asks to stop, dispatching each exit on its
+// exit_reason.  Port I/O is looked up in a flat per-port table and MMIO in
+// a table of ranges sorted by address.  A KVM_RUN interrupted with EINTR
+// or EAGAIN is dispatched as KVM_EXIT_INTR, which resumes unless a
+// handler is set for it.
+class run_loop {
+public:
+    enum action { resume, stop };
+    typedef std::tr1::function<action (uint16_t port, bool out, void *data,
+                                       unsigned size, unsigned count)>
+        pio_handler;
+    typedef std::tr1::function<action (uint64_t gpa, bool write, void *data,
+                                       unsigned len)>
+        mmio_handler;
+    typedef std::tr1::function<action (kvm_run *run)> exit_handler;
+public:
+    explicit run_loop(vcpu& vcpu);
+    void add_pio(uint16_t port, unsigned nr_ports, pio_handler handler);
+    void add_mmio(uint64_t gpa, uint64_t len, mmio_handler handler);
+    void set_handler(uint32_t exit_reason, exit_handler handler);
+    // returns the exit_reason of the exit that ended the loop
+    uint32_t run();
+    uint64_t nr_exits() const { return _nr_exits; }
+private:
+    action dispatch(kvm_run *run);
+    action dispatch_pio(kvm_run *run);
+    action dispatch_mmio(kvm_run *run);
+    action dispatch_coalesced();
+    mmio_handler *find_mmio(uint64_t gpa);
+private:
+    struct mmio_range {
+        uint64_t gpa;
+        uint64_t len;
+        mmio_handler handler;
+        bool operator<(const mmio_range& other) const {
+            return gpa < other.gpa;
+        }
+    };
+    vcpu& _vcpu;
+    std::vector<uint16_t> _pio_index;
+    std::vector<pio_handler> _pio_handlers;
+    std::vector<mmio_range> _mmio;
+    std::vector<exit_handler> _handlers;
+    uint64_t _nr_exits;
+};
+
 class system {
 public:
     explicit system(std::string device_node = "/dev/kvm");
     bool check_extension(int extension);
     int get_extension_int(int extension);
+    std::vector<uint32_t> msr_index_list();
 private:
     fd _fd;
     friend class vcpu;
@@ -1,21 +1,39 @@
 
 #include "memmap.hh"
+#include "exception.hh"
+#include <algorithm>
 
 mem_slot::mem_slot(mem_map& map, uint64_t gpa, uint64_t size, void* hva)
     : _map(map)
-    , _slot(map._free_slots.top())
+    , _slot(map.take_slot(gpa, size))
     , _gpa(gpa)
     , _size(size)
     , _hva(hva)
     , _dirty_log_enabled(false)
+    , _clear_chunk(0)
     , _log()
+    , _dirty()
+    , _dirty_listed(true)
+    , _ring_pages()
 {
-    map._free_slots.pop();
-    update();
+    try {
+        update();
+    } catch (...) {
+        map._free_slots.push(_slot);
+        throw;
+    }
+    _map._slots[_slot] = this;
+    if (_size) {
+        _map._by_gpa[_gpa] = this;
+    }
 }
 
 mem_slot::~mem_slot()
 {
+    _map._slots[_slot] = NULL;
+    if (_size) {
+        _map._by_gpa.erase(_gpa);
+    }
     _size = 0;
     try {
         update();
@@ -35,6 +53,9 @@ void mem_slot::set_dirty_logging(bool enabled)
         } else {
             _log.resize(0);
         }
+        _dirty.clear();
+        _dirty_listed = true;
+        _ring_pages.clear();
         update();
     }
 }
@@ -55,7 +76,141 @@ bool mem_slot::dirty_logging() const
 
 void mem_slot::update_dirty_log()
 {
+    if (_map._vm.dirty_ring_size()) {
+        update_dirty_ring();
+        return;
+    }
     _map._vm.get_dirty_log(_slot, &_log[0]);
+    _dirty_listed = false;
+    if (_map._vm.manual_dirty_log_protect() && _clear_chunk) {
+        uint64_t nr_pages = _size >> 12;
+        for (uint64_t page = 0; page < nr_pages; page += _clear_chunk) {
+            clear_dirty_log(page, std::min(_clear_chunk, nr_pages - page));
+        }
+    }
+}
+
+void mem_slot::clear_dirty_log(uint64_t first_page, uint64_t nr_pages)
+{
+    // one ioctl covers at most 2^31 pages, and chunks with no dirty page
+    // need no ioctl at all
+    const uint64_t max_pages = 1ULL << 31;
+    while (nr_pages) {
+        uint64_t n = std::min(nr_pages, max_pages);
+        ulong first = first_page / bits_per_word;
+        ulong last = (first_page + n + bits_per_word - 1) / bits_per_word;
+        for (ulong w = first; w < last; ++w) {
+            if (_log[w]) {
+                _map._vm.clear_dirty_log(_slot, &_log[first], first_page, n);
+                break;
+            }
+        }
+        first_page += n;
+        nr_pages -= n;
+    }
+}
+
+void mem_slot::set_clear_chunk(uint64_t nr_pages)
+{
+    _clear_chunk = nr_pages;
+}
+
+// The ring only reports newly dirtied pages, so both the bitmap and the gpa
+// list are rebuilt from the previous round's list rather than from scratch;
+// the cost is proportional to the number of dirty pages, not the slot size.
+void mem_slot::update_dirty_ring()
+{
+    _map.harvest_dirty_rings();
+    for (dirty_iterator i = _dirty.begin(); i != _dirty.end(); ++i) {
+        uint64_t pagenr = (*i - _gpa) >> 12;
+        _log[pagenr / bits_per_word] &= ~(1UL << (pagenr % bits_per_word));
+    }
+    _dirty.clear();
+    for (std::vector<uint64_t>::const_iterator i = _ring_pages.begin();
+         i != _ring_pages.end(); ++i) {
+        ulong& word = _log[*i / bits_per_word];
+        ulong bit = 1UL << (*i % bits_per_word);
+        if (!(word & bit)) {
+            word |= bit;
+            _dirty.push_back(_gpa + (*i << 12));
+        }
+    }
+    _ring_pages.clear();
+    _dirty_listed = true;
+}
+
+void mem_slot::add_dirty(uint64_t gpa)
+{
+    _dirty.push_back(gpa);
+}
+
+void mem_slot::fill_dirty_list()
+{
+    _dirty.clear();
+    for_each_dirty(std::tr1::bind(&mem_slot::add_dirty, this,
+                                  std::tr1::placeholders::_1));
+    _dirty_listed = true;
+}
+
+void mem_slot::for_each_dirty(dirty_callback cb) const
+{
+    if (_dirty_listed) {
+        for (dirty_iterator i = _dirty.begin(); i != _dirty.end(); ++i) {
+            cb(*i);
+        }
+        return;
+    }
+    for (ulong wordnr = 0; wordnr < _log.size(); ++wordnr) {
+        ulong word = _log[wordnr];
+        while (word) {
+            uint64_t pagenr = uint64_t(wordnr) * bits_per_word
+                + __builtin_ctzl(word);
+            cb(_gpa + (pagenr << 12));
+            word &= word - 1;
+        }
+    }
+}
+
+// Returns the first page at or after pagenr whose dirty bit equals dirty,
+// or the number of pages covered by the log if there is none.
+uint64_t mem_slot::find_next(uint64_t pagenr, bool dirty) const
+{
+    ulong flip = dirty ? 0 : ~0UL;
+    ulong wordnr = pagenr / bits_per_word;
+    if (wordnr >= _log.size()) {
+        return uint64_t(_log.size()) * bits_per_word;
+    }
+    ulong word = (_log[wordnr] ^ flip) & (~0UL << (pagenr % bits_per_word));
+    while (!word) {
+        if (++wordnr == _log.size()) {
+            return uint64_t(wordnr) * bits_per_word;
+        }
+        word = _log[wordnr] ^ flip;
+    }
+    return uint64_t(wordnr) * bits_per_word + __builtin_ctzl(word);
+}
+
+void mem_slot::for_each_dirty_run(dirty_run_callback cb) const
+{
+    uint64_t nr_pages = _size >> 12;
+    uint64_t pagenr = find_next(0, true);
+    while (pagenr < nr_pages) {
+        uint64_t end = std::min(find_next(pagenr, false), nr_pages);
+        cb(_gpa + (pagenr << 12), (end - pagenr) << 12);
+        pagenr = find_next(end, true);
+    }
+}
+
+uint64_t mem_slot::dirty_count() const
+{
+    if (_dirty_listed) {
+        return _dirty.size();
+    }
+    uint64_t count = 0;
+    for (ulong wordnr = 0; wordnr < _log.size(); ++wordnr) {
+        count += __builtin_popcountl(_log[wordnr]);
+    }
+    return count;
 }
 
 bool mem_slot::is_dirty(uint64_t gpa) const
@@ -66,6 +221,22 @@ bool mem_slot::is_dirty(uint64_t gpa) const
     return _log[wordnr] & bit;
 }
 
+mem_slot::dirty_iterator mem_slot::dirty_begin()
+{
+    if (!_dirty_listed) {
+        fill_dirty_list();
+    }
+    return _dirty.begin();
+}
+
+mem_slot::dirty_iterator mem_slot::dirty_end()
+{
+    if (!_dirty_listed) {
+        fill_dirty_list();
+    }
+    return _dirty.end();
+}
+
 mem_map::mem_map(kvm::vm& vm)
     : _vm(vm)
 {
@@ -73,4 +244,182 @@ mem_map::mem_map(kvm::vm& vm)
     for (int i = 0; i < nr_slots; ++i) {
         _free_slots.push(i);
     }
+    _slots.resize(nr_slots);
+}
+
+std::vector<mem_slot*> mem_map::slots() const
+{
+    std::vector<mem_slot*> ret;
+    for (gpa_index::const_iterator i = _by_gpa.begin(); i != _by_gpa.end();
+         ++i) {
+        ret.push_back(i->second);
+    }
+    return ret;
+}
+
+// Slots never overlap, so only the last one starting below the end of a
+// range can overlap it.
+bool mem_map::overlaps(uint64_t gpa, uint64_t size) const
+{
+    gpa_index::const_iterator i = _by_gpa.lower_bound(gpa + size);
+    if (!size || i == _by_gpa.begin()) {
+        return false;
+    }
+    --i;
+    return i->second->gpa() + i->second->size() > gpa;
+}
+
+int mem_map::take_slot(uint64_t gpa, uint64_t size)
+{
+    if (overlaps(gpa, size)) {
+        throw errno_exception(EEXIST);
+    }
+    if (_free_slots.empty()) {
+        throw errno_exception(ENOSPC);
+    }
+    int slot = _free_slots.top();
+    _free_slots.pop();
+    return slot;
+}
+
+mem_slot* mem_map::find(uint64_t gpa) const
+{
+    gpa_index::const_iterator i = _by_gpa.upper_bound(gpa);
+    if (i == _by_gpa.begin()) {
+        return NULL;
+    }
+    --i;
+    mem_slot* slot = i->second;
+    return gpa - slot->gpa() < slot->size() ? slot : NULL;
+}
+
+void* mem_map::hva_for(uint64_t gpa) const
+{
+    mem_slot* slot = find(gpa);
+    if (!slot) {
+        return NULL;
+    }
+    return static_cast<char*>(slot->hva()) + (gpa - slot->gpa());
+}
+
+bool mem_map::owned(mem_slot* slot) const
+{
+    std::map<uint64_t, mem_slot_ptr>::const_iterator i
+        = _owned.find(slot->gpa());
+    return i != _owned.end() && i->second.get() == slot;
+}
+
+mem_slot* mem_map::add_owned(uint64_t gpa, uint64_t size, void* hva)
+{
+    mem_slot_ptr slot(new mem_slot(*this, gpa, size, hva));
+    _owned[gpa] = slot;
+    return slot.get();
+}
+
+mem_slot* mem_map::map_range(uint64_t gpa, uint64_t size, void* hva)
+{
+    if (overlaps(gpa, size)) {
+        throw errno_exception(EEXIST);
+    }
+    char* start = static_cast<char*>(hva);
+    mem_slot* left = gpa ? find(gpa - 1) : NULL;
+    if (left && (!owned(left) || left->dirty_logging()
+                 || static_cast<char*>(left->hva()) + left->size() != start)) {
+        left = NULL;
+    }
+    mem_slot* right = find(gpa + size);
+    if (right && (!owned(right) || right->dirty_logging()
+                  || right->hva() != start + size)) {
+        right = NULL;
+    }
+    uint64_t new_gpa = gpa, new_size = size;
+    void* new_hva = hva;
+    std::vector<mem_slot*> merged;
+    if (left) {
+        new_gpa = left->gpa();
+        new_hva = left->hva();
+        new_size += left->size();
+        merged.push_back(left);
+    }
+    if (right) {
+        new_size += right->size();
+        merged.push_back(right);
+    }
+    // the merged slot overlaps its parts, so they go first
+    std::vector<uint64_t> gpas, sizes;
+    std::vector<void*> hvas;
+    for (unsigned i = 0; i < merged.size(); ++i) {
+        gpas.push_back(merged[i]->gpa());
+        sizes.push_back(merged[i]->size());
+        hvas.push_back(merged[i]->hva());
+        _owned.erase(merged[i]->gpa());
+    }
+    try {
+        return add_owned(new_gpa, new_size, new_hva);
+    } catch (...) {
+        for (unsigned i = 0; i < gpas.size(); ++i) {
+            add_owned(gpas[i], sizes[i], hvas[i]);
+        }
+        throw;
+    }
+}
+
+void mem_map::unmap_range(uint64_t gpa, uint64_t size)
+{
+    uint64_t end = gpa + size;
+    gpa_index::const_iterator first = _by_gpa.upper_bound(gpa);
+    if (first != _by_gpa.begin()) {
+        gpa_index::const_iterator prev = first;
+        --prev;
+        if (prev->second->gpa() + prev->second->size() > gpa) {
+            first = prev;
+        }
+    }
+    std::vector<mem_slot*> hit;
+    for (gpa_index::const_iterator i = first;
+         i != _by_gpa.end() && i->first < end; ++i) {
+        if (!owned(i->second)) {
+            throw errno_exception(EINVAL);
+        }
+        hit.push_back(i->second);
+    }
+    for (unsigned i = 0; i < hit.size(); ++i) {
+        uint64_t slot_gpa = hit[i]->gpa();
+        uint64_t slot_end = slot_gpa + hit[i]->size();
+        char* slot_hva = static_cast<char*>(hit[i]->hva());
+        _owned.erase(slot_gpa);
+        if (slot_gpa < gpa) {
+            add_owned(slot_gpa, gpa - slot_gpa, slot_hva);
+        }
+        if (slot_end > end) {
+            add_owned(end, slot_end - end, slot_hva + (end - slot_gpa));
+        }
+    }
+}
+
+void mem_map::add_vcpu(kvm::vcpu& vcpu)
+{
+    _vcpus.push_back(&vcpu);
+}
+
+// Harvesting a ring yields pages of every slot, so entries are queued on
+// their slots and consumed by each slot's next update_dirty_log().
+void mem_map::harvest_dirty_rings()
+{
+    _gfns.clear();
+    for (std::vector<kvm::vcpu*>::iterator i = _vcpus.begin();
+         i != _vcpus.end(); ++i) {
+        (*i)->harvest_dirty_ring(_gfns);
+    }
+    for (std::vector<kvm_dirty_gfn>::const_iterator i = _gfns.begin();
+         i != _gfns.end(); ++i) {
+        unsigned slot = i->slot & 0xffff;
+        if (slot < _slots.size() && _slots[slot]
+            && _slots[slot]->_dirty_log_enabled) {
+            _slots[slot]->_ring_pages.push_back(i->offset);
+        }
+    }
+    if (!_gfns.empty()) {
+        _vm.reset_dirty_rings();
+    }
 }
@@ -5,20 +5,48 @@
 #include <stdint.h>
 #include <vector>
 #include <stack>
+#include <map>
+#include <tr1/functional>
+#include <tr1/memory>
 
 class mem_map;
 class mem_slot;
 
 class mem_slot {
+public:
+    typedef std::vector<uint64_t>::const_iterator dirty_iterator;
+    typedef std::tr1::function<void (uint64_t gpa)> dirty_callback;
+    typedef std::tr1::function<void (uint64_t gpa, uint64_t size)>
+        dirty_run_callback;
 public:
     mem_slot(mem_map& map, uint64_t gpa, uint64_t size, void *hva);
     ~mem_slot();
+    uint64_t gpa() const { return _gpa; }
+    uint64_t size() const { return _size; }
+    void *hva() const { return _hva; }
     void set_dirty_logging(bool enabled);
     bool dirty_logging() const;
     void update_dirty_log();
     bool is_dirty(uint64_t gpa) const;
+    // with manual dirty log protection: re-protect the pages of the given
+    // range that the last update_dirty_log() reported dirty
+    void clear_dirty_log(uint64_t first_page, uint64_t nr_pages);
+    // re-protect in chunks of this many pages (a multiple of 64) from
+    // update_dirty_log(); 0 leaves clearing to the caller
+    void set_clear_chunk(uint64_t nr_pages);
+    // gpas of the pages found dirty by the last update_dirty_log()
+    dirty_iterator dirty_begin();
+    dirty_iterator dirty_end();
+    // walk the dirty log a word at a time, skipping clean words
+    void for_each_dirty(dirty_callback cb) const;
+    void for_each_dirty_run(dirty_run_callback cb) const;
+    uint64_t dirty_count() const;
 private:
     void update();
+    void update_dirty_ring();
+    void fill_dirty_list();
+    void add_dirty(uint64_t gpa);
+    uint64_t find_next(uint64_t pagenr, bool dirty) const;
 private:
     typedef unsigned long ulong;
     static const int bits_per_word = sizeof(ulong) * 8;
@@ -28,15 +56,54 @@ private:
     uint64_t _size;
     void *_hva;
     bool _dirty_log_enabled;
+    uint64_t _clear_chunk;
     std::vector<ulong> _log;
+    std::vector<uint64_t> _dirty;
+    bool _dirty_listed;
+    std::vector<uint64_t> _ring_pages;
+    friend class mem_map;
 };
 
+// Slots are indexed by gpa; a new slot that overlaps a live one fails
+// with EEXIST, and one beyond KVM_CAP_NR_MEMSLOTS with ENOSPC.
 class mem_map {
 public:
     mem_map(kvm::vm& vm);
+    kvm::vm& vm() { return _vm; }
+    // live slots, by ascending gpa
+    std::vector<mem_slot*> slots() const;
+    // the slot containing gpa, or NULL
+    mem_slot* find(uint64_t gpa) const;
+    // the host address of gpa, or NULL if no slot contains it
+    void* hva_for(uint64_t gpa) const;
+    unsigned free_slots() const { return _free_slots.size(); }
+    // Slots owned by the map.  map_range() merges the new range with owned
+    // neighbours that are contiguous in both gpa and hva and not dirty
+    // logging; unmap_range() removes a range from owned slots, splitting
+    // them as needed, and fails with EINVAL if it touches a slot the map
+    // does not own.  The vcpus must be stopped, since merged and split
+    // ranges are briefly unmapped.
+    mem_slot* map_range(uint64_t gpa, uint64_t size, void* hva);
+    void unmap_range(uint64_t gpa, uint64_t size);
+    // vcpus whose dirty rings are harvested when the vm uses a dirty ring
+    void add_vcpu(kvm::vcpu& vcpu);
+    void harvest_dirty_rings();
+private:
+    typedef std::map<uint64_t, mem_slot*> gpa_index;
+    typedef std::tr1::shared_ptr<mem_slot> mem_slot_ptr;
+    bool overlaps(uint64_t gpa, uint64_t size) const;
+    int take_slot(uint64_t gpa, uint64_t size);
+    bool owned(mem_slot* slot) const;
+    mem_slot* add_owned(uint64_t gpa, uint64_t size, void* hva);
 private:
     kvm::vm& _vm;
     std::stack<int> _free_slots;
+    gpa_index _by_gpa;
+    std::vector<mem_slot*> _slots;
+    std::vector<kvm::vcpu*> _vcpus;
+    std::vector<kvm_dirty_gfn> _gfns;
+    // last, so that owned slots go while the rest of the map is intact
+    std::map<uint64_t, mem_slot_ptr> _owned;
     friend class mem_slot;
 };
 
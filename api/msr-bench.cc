@@ -0,0 +1,128 @@
+// Compares the cost of saving and restoring a set of msrs through the
+// vector-based vcpu::msrs() and the allocation-free batch and span calls.
+
+#include "kvmxx.hh"
+#include "exception.hh"
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+namespace {
+
+const unsigned max_msrs = 512;
+
+uint64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// keep the msrs that can be both read and written back from the host
+std::vector<uint32_t> usable_msrs(kvm::vcpu& vcpu,
+                                  const std::vector<uint32_t>& candidates,
+                                  unsigned limit)
+{
+    std::vector<uint32_t> ret;
+    for (unsigned i = 0; i < candidates.size() && ret.size() < limit; ++i) {
+        uint64_t value;
+        if (vcpu.get_msrs(&candidates[i], &value, 1) == 1
+            && vcpu.set_msrs(&candidates[i], &value, 1) == 1) {
+            ret.push_back(candidates[i]);
+        }
+    }
+    return ret;
+}
+
+void report(const char* name, uint64_t ns, unsigned iterations,
+            unsigned nr_msrs)
+{
+    double per_call = double(ns) / iterations;
+    printf("%-12s %10.0f ns/call %8.1f ns/msr\n", name, per_call,
+           per_call / nr_msrs);
+}
+
+int test_main(int ac, char** av)
+{
+    unsigned iterations = 10000;
+    unsigned limit = max_msrs;
+    int c;
+    while ((c = getopt(ac, av, "i:n:")) != -1) {
+        switch (c) {
+        case 'i':
+            iterations = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            limit = std::min(unsigned(strtoul(optarg, NULL, 0)), max_msrs);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-i iterations] [-n msrs]\n", av[0]);
+            return 2;
+        }
+    }
+    if (!iterations || !limit) {
+        return 2;
+    }
+
+    kvm::system sys;
+    kvm::vm vm(sys);
+    kvm::vcpu vcpu(vm, 0);
+    std::vector<uint32_t> indices = usable_msrs(vcpu, sys.msr_index_list(),
+                                                limit);
+    unsigned n = indices.size();
+    if (!n) {
+        fprintf(stderr, "no usable msrs\n");
+        return 1;
+    }
+    printf("%u msrs, %u iterations\n", n, iterations);
+
+    uint64_t t = now_ns();
+    std::vector<kvm_msr_entry> entries;
+    for (unsigned i = 0; i < iterations; ++i) {
+        entries = vcpu.msrs(indices);
+    }
+    report("vector get", now_ns() - t, iterations, n);
+    t = now_ns();
+    for (unsigned i = 0; i < iterations; ++i) {
+        vcpu.set_msrs(entries);
+    }
+    report("vector set", now_ns() - t, iterations, n);
+
+    static kvm::msr_batch<max_msrs> batch;
+    for (unsigned i = 0; i < n; ++i) {
+        batch.add(indices[i]);
+    }
+    t = now_ns();
+    for (unsigned i = 0; i < iterations; ++i) {
+        vcpu.get_msrs(batch);
+    }
+    report("batch get", now_ns() - t, iterations, n);
+    t = now_ns();
+    for (unsigned i = 0; i < iterations; ++i) {
+        vcpu.set_msrs(batch);
+    }
+    report("batch set", now_ns() - t, iterations, n);
+
+    std::vector<uint64_t> values(n);
+    t = now_ns();
+    for (unsigned i = 0; i < iterations; ++i) {
+        vcpu.get_msrs(&indices[0], &values[0], n);
+    }
+    report("span get", now_ns() - t, iterations, n);
+    t = now_ns();
+    for (unsigned i = 0; i < iterations; ++i) {
+        vcpu.set_msrs(&indices[0], &values[0], n);
+    }
+    report("span set", now_ns() - t, iterations, n);
+    return 0;
+}
+
+}
+
+int main(int ac, char** av)
+{
+    return try_main(test_main, ac, av);
+}
@@ -0,0 +1,359 @@
+#define _FILE_OFFSET_BITS 64
+
+#include "snapshot.hh"
+#include "exception.hh"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <algorithm>
+
+namespace {
+
+const char snapshot_magic[8] = { 'K', 'V', 'M', 'S', 'N', 'A', 'P', 0 };
+const uint32_t snapshot_version = 1;
+
+int check_error(int r)
+{
+    if (r == -1) {
+        throw errno_exception(errno);
+    }
+    return r;
+}
+
+void pwrite_all(int fd, const void *buf, uint64_t len, uint64_t offset)
+{
+    const char *p = static_cast<const char *>(buf);
+    while (len) {
+        size_t chunk = std::min(len, uint64_t(1) << 30);
+        ssize_t r = ::pwrite(fd, p, chunk, offset);
+        if (r == -1 && errno == EINTR) {
+            continue;
+        }
+        check_error(r);
+        p += r;
+        len -= r;
+        offset += r;
+    }
+}
+
+void pread_all(int fd, void *buf, uint64_t len, uint64_t offset)
+{
+    char *p = static_cast<char *>(buf);
+    while (len) {
+        ssize_t r = ::pread(fd, p, len, offset);
+        if (r == -1 && errno == EINTR) {
+            continue;
+        }
+        check_error(r);
+        if (r == 0) {
+            throw errno_exception(EINVAL);
+        }
+        p += r;
+        len -= r;
+        offset += r;
+    }
+}
+
+uint64_t records_size(unsigned nr_slots, unsigned nr_vcpus)
+{
+    return sizeof(snapshot_header) + nr_slots * sizeof(snapshot_slot)
+        + nr_vcpus * sizeof(snapshot_vcpu);
+}
+
+uint64_t page_align(uint64_t x)
+{
+    uint64_t page_size = ::getpagesize();
+    return (x + page_size - 1) & ~(page_size - 1);
+}
+
+// KVM_GET/SET_MSRS stop at the first msr they refuse; skip it and go on
+std::vector<uint32_t> readable_msrs(kvm::vcpu& vcpu,
+                                    const std::vector<uint32_t>& candidates)
+{
+    std::vector<uint32_t> ret;
+    for (unsigned i = 0; i < candidates.size()
+             && ret.size() < snapshot_vcpu::max_msrs; ++i) {
+        uint64_t value;
+        if (vcpu.get_msrs(&candidates[i], &value, 1) == 1) {
+            ret.push_back(candidates[i]);
+        }
+    }
+    return ret;
+}
+
+void restore_msrs(kvm::vcpu& vcpu, const snapshot_vcpu& rec)
+{
+    kvm::msr_batch<snapshot_vcpu::max_msrs> batch;
+    unsigned done = 0;
+    while (done < rec.nr_msrs) {
+        batch.clear();
+        for (unsigned i = done; i < rec.nr_msrs; ++i) {
+            batch.add(rec.msrs[i].index, rec.msrs[i].data);
+        }
+        // resume past the msr that was refused, if any
+        done += vcpu.set_msrs(batch) + 1;
+    }
+}
+
+}
+
+snapshot::snapshot(mem_map& map, const std::string& path)
+    : _map(map)
+    , _path(path)
+    , _fd(check_error(::open(path.c_str(), O_RDWR | O_CREAT, 0644)))
+    , _layout_vcpus(0)
+{
+}
+
+void snapshot::add_vcpu(kvm::vcpu& vcpu)
+{
+    if (_msr_indices.empty()) {
+        _msr_indices = readable_msrs(vcpu, _map.vm().sys().msr_index_list());
+    }
+    _vcpus.push_back(&vcpu);
+}
+
+void snapshot::save_vcpu(kvm::vcpu& vcpu, snapshot_vcpu& rec)
+{
+    memset(&rec, 0, sizeof(rec));
+    rec.regs = vcpu.regs();
+    rec.sregs = vcpu.sregs();
+    rec.events = vcpu.events();
+    rec.events.flags |= KVM_VCPUEVENT_VALID_NMI_PENDING;
+    rec.fpu = vcpu.fpu();
+    if (_msr_indices.empty()) {
+        return;
+    }
+    uint64_t values[snapshot_vcpu::max_msrs];
+    rec.nr_msrs = vcpu.get_msrs(&_msr_indices[0], values,
+                                _msr_indices.size());
+    for (unsigned i = 0; i < rec.nr_msrs; ++i) {
+        rec.msrs[i].index = _msr_indices[i];
+        rec.msrs[i].data = values[i];
+    }
+}
+
+// A slot whose dirty logging was turned off since the last save has no
+// log to save from, so it needs a full save as much as a new slot does.
+// The images start after the vcpu records, so a vcpu added since the last
+// save moves them too.
+bool snapshot::same_layout(const std::vector<mem_slot*>& slots) const
+{
+    if (slots.size() != _layout.size() || _vcpus.size() != _layout_vcpus) {
+        return false;
+    }
+    for (unsigned i = 0; i < slots.size(); ++i) {
+        if (slots[i]->gpa() != _layout[i].gpa
+            || slots[i]->size() != _layout[i].size
+            || !slots[i]->dirty_logging()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Images hold a shared lock on the file while they map it.  Rewriting it
+// in place would change or truncate their memory under them, so then the
+// save goes to a new file, which replaces the old one once it is complete;
+// the images keep the old one.
+uint64_t snapshot::save()
+{
+    if (::flock(_fd.get(), LOCK_EX | LOCK_NB) == 0) {
+        uint64_t written = save_to_file();
+        ::flock(_fd.get(), LOCK_UN);
+        return written;
+    }
+    if (errno != EWOULDBLOCK) {
+        throw errno_exception(errno);
+    }
+    std::string tmp_path = _path + ".tmp";
+    kvm::fd tmp(check_error(::open(tmp_path.c_str(),
+                                   O_RDWR | O_CREAT | O_TRUNC, 0644)));
+    kvm::fd old(_fd);
+    check_error(::dup2(tmp.get(), _fd.get()));
+    _layout.clear();
+    try {
+        uint64_t written = save_to_file();
+        check_error(::rename(tmp_path.c_str(), _path.c_str()));
+        return written;
+    } catch (...) {
+        ::dup2(old.get(), _fd.get());
+        ::unlink(tmp_path.c_str());
+        throw;
+    }
+}
+
+uint64_t snapshot::save_to_file()
+{
+    std::vector<mem_slot*> slots = _map.slots();
+    uint64_t written;
+    if (same_layout(slots)) {
+        written = save_dirty(slots);
+    } else {
+        written = save_full(slots);
+    }
+    _vcpu_recs.resize(_vcpus.size());
+    for (unsigned i = 0; i < _vcpus.size(); ++i) {
+        save_vcpu(*_vcpus[i], _vcpu_recs[i]);
+    }
+    snapshot_header hdr = {};
+    memcpy(hdr.magic, snapshot_magic, sizeof(hdr.magic));
+    hdr.version = snapshot_version;
+    hdr.page_size = ::getpagesize();
+    hdr.nr_slots = _layout.size();
+    hdr.nr_vcpus = _vcpus.size();
+    uint64_t off = sizeof(hdr);
+    if (!_layout.empty()) {
+        pwrite_all(_fd.get(), &_layout[0],
+                   _layout.size() * sizeof(snapshot_slot), off);
+    }
+    off += _layout.size() * sizeof(snapshot_slot);
+    if (!_vcpu_recs.empty()) {
+        pwrite_all(_fd.get(), &_vcpu_recs[0],
+                   _vcpu_recs.size() * sizeof(snapshot_vcpu), off);
+    }
+    // the header goes last, so that a torn first save is not recognized
+    pwrite_all(_fd.get(), &hdr, sizeof(hdr), 0);
+    return written;
+}
+
+// Dirty logging is reset before memory is copied, so a page written
+// while copying shows up in the next save.
+uint64_t snapshot::save_full(const std::vector<mem_slot*>& slots)
+{
+    _layout.resize(slots.size());
+    _layout_vcpus = _vcpus.size();
+    uint64_t off = page_align(records_size(slots.size(), _layout_vcpus));
+    for (unsigned i = 0; i < slots.size(); ++i) {
+        _layout[i].gpa = slots[i]->gpa();
+        _layout[i].size = slots[i]->size();
+        _layout[i].offset = off;
+        off = page_align(off + slots[i]->size());
+    }
+    check_error(::ftruncate(_fd.get(), off));
+    uint64_t written = 0;
+    for (unsigned i = 0; i < slots.size(); ++i) {
+        slots[i]->set_dirty_logging(true);
+        slots[i]->update_dirty_log();
+        pwrite_all(_fd.get(), slots[i]->hva(), slots[i]->size(),
+                   _layout[i].offset);
+        written += slots[i]->size();
+    }
+    return written;
+}
+
+void snapshot::write_run(const snapshot_slot& rec, const mem_slot& slot,
+                         uint64_t& written, uint64_t gpa, uint64_t size)
+{
+    uint64_t delta = gpa - rec.gpa;
+    pwrite_all(_fd.get(), static_cast<char *>(slot.hva()) + delta, size,
+               rec.offset + delta);
+    written += size;
+}
+
+uint64_t snapshot::save_dirty(const std::vector<mem_slot*>& slots)
+{
+    using namespace std::tr1::placeholders;
+    uint64_t written = 0;
+    for (unsigned i = 0; i < slots.size(); ++i) {
+        slots[i]->update_dirty_log();
+        slots[i]->for_each_dirty_run(
+            std::tr1::bind(&snapshot::write_run, this,
+                           std::tr1::cref(_layout[i]),
+                           std::tr1::cref(*slots[i]),
+                           std::tr1::ref(written), _1, _2));
+    }
+    return written;
+}
+
+snapshot_image::snapshot_image(const std::string& path)
+    : _fd(check_error(::open(path.c_str(), O_RDONLY)))
+{
+    // waits for an in-place save to finish, and keeps later ones out
+    check_error(::flock(_fd.get(), LOCK_SH));
+    snapshot_header hdr;
+    pread_all(_fd.get(), &hdr, sizeof(hdr), 0);
+    if (memcmp(hdr.magic, snapshot_magic, sizeof(hdr.magic))
+        || hdr.version != snapshot_version
+        || hdr.page_size != uint32_t(::getpagesize())) {
+        throw errno_exception(EINVAL);
+    }
+    _layout.resize(hdr.nr_slots);
+    _vcpu_recs.resize(hdr.nr_vcpus);
+    uint64_t off = sizeof(hdr);
+    if (hdr.nr_slots) {
+        pread_all(_fd.get(), &_layout[0],
+                  hdr.nr_slots * sizeof(snapshot_slot), off);
+    }
+    off += hdr.nr_slots * sizeof(snapshot_slot);
+    if (hdr.nr_vcpus) {
+        pread_all(_fd.get(), &_vcpu_recs[0],
+                  hdr.nr_vcpus * sizeof(snapshot_vcpu), off);
+    }
+}
+
+snapshot_image::~snapshot_image()
+{
+    _slots.clear();
+    for (unsigned i = 0; i < _mappings.size(); ++i) {
+        ::munmap(_mappings[i].addr, _mappings[i].len);
+    }
+}
+
+void snapshot_image::restore_memory(mem_map& map)
+{
+    for (unsigned i = 0; i < _layout.size(); ++i) {
+        const snapshot_slot& rec = _layout[i];
+        void *addr = ::mmap(NULL, rec.size, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE, _fd.get(), rec.offset);
+        if (addr == MAP_FAILED) {
+            throw errno_exception(errno);
+        }
+        mapping m = { addr, size_t(rec.size) };
+        _mappings.push_back(m);
+        _slots.push_back(mem_slot_ptr(new mem_slot(map, rec.gpa, rec.size,
+                                                   addr)));
+    }
+}
+
+// /proc/self/pagemap has one 64-bit entry per page: bit 63 is set for a
+// present page and bit 61 for a file-backed one, so a present page with
+// bit 61 clear has been copied on write.
+uint64_t snapshot_image::private_pages() const
+{
+    const uint64_t present = 1ULL << 63, file = 1ULL << 61;
+    kvm::fd pagemap(check_error(::open("/proc/self/pagemap", O_RDONLY)));
+    uint64_t page_size = ::getpagesize();
+    uint64_t count = 0;
+    uint64_t entries[512];
+    for (unsigned i = 0; i < _mappings.size(); ++i) {
+        uint64_t first = reinterpret_cast<unsigned long>(_mappings[i].addr)
+            / page_size;
+        uint64_t nr = _mappings[i].len / page_size;
+        for (uint64_t done = 0; done < nr; ) {
+            uint64_t n = std::min(nr - done, uint64_t(512));
+            pread_all(pagemap.get(), entries, n * sizeof(entries[0]),
+                      (first + done) * sizeof(entries[0]));
+            for (unsigned j = 0; j < n; ++j) {
+                if ((entries[j] & (present | file)) == present) {
+                    ++count;
+                }
+            }
+            done += n;
+        }
+    }
+    return count;
+}
+
+void snapshot_image::restore_vcpu(unsigned index, kvm::vcpu& vcpu)
+{
+    const snapshot_vcpu& rec = _vcpu_recs.at(index);
+    vcpu.set_sregs(rec.sregs);
+    vcpu.set_regs(rec.regs);
+    vcpu.set_fpu(rec.fpu);
+    restore_msrs(vcpu, rec);
+    vcpu.set_events(rec.events);
+}
@@ -0,0 +1,100 @@
+#ifndef API_SNAPSHOT_HH
+#define API_SNAPSHOT_HH
+
+#include "kvmxx.hh"
+#include "memmap.hh"
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <tr1/memory>
+
+// On-disk layout: a header, the slot and vcpu records, then one
+// page-aligned image per slot, so that an image can be mapped directly.
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t nr_slots;
+    uint32_t nr_vcpus;
+};
+
+struct snapshot_slot {
+    uint64_t gpa;
+    uint64_t size;
+    uint64_t offset;
+};
+
+struct snapshot_vcpu {
+    static const unsigned max_msrs = 256;
+    kvm_regs regs;
+    kvm_sregs sregs;
+    kvm_vcpu_events events;
+    kvm_fpu fpu;
+    uint32_t nr_msrs;
+    uint32_t pad;
+    kvm_msr_entry msrs[max_msrs];
+};
+
+// Saves a vm's vcpus and the slots of its mem_map to a file.  The first
+// save writes all of guest memory and turns on dirty logging; later saves
+// rewrite only the pages dirtied since the previous one, unless the slot
+// layout changed in between or a snapshot_image has the file mapped.  In
+// the latter case the save writes a new file and renames it over the old
+// one.  The vcpus must be stopped while saving.  With manual dirty log
+// protection, give the slots a clear chunk.
+class snapshot {
+public:
+    snapshot(mem_map& map, const std::string& path);
+    void add_vcpu(kvm::vcpu& vcpu);
+    // returns the number of bytes of guest memory written
+    uint64_t save();
+private:
+    uint64_t save_to_file();
+    void save_vcpu(kvm::vcpu& vcpu, snapshot_vcpu& rec);
+    bool same_layout(const std::vector<mem_slot*>& slots) const;
+    uint64_t save_full(const std::vector<mem_slot*>& slots);
+    uint64_t save_dirty(const std::vector<mem_slot*>& slots);
+    void write_run(const snapshot_slot& rec, const mem_slot& slot,
+                   uint64_t& written, uint64_t gpa, uint64_t size);
+private:
+    mem_map& _map;
+    std::string _path;
+    kvm::fd _fd;
+    std::vector<kvm::vcpu*> _vcpus;
+    std::vector<uint32_t> _msr_indices;
+    std::vector<snapshot_slot> _layout;
+    // the number of vcpu records _layout leaves room for
+    unsigned _layout_vcpus;
+    std::vector<snapshot_vcpu> _vcpu_recs;
+};
+
+// A saved snapshot, restored into another vm.  Guest memory is mapped
+// MAP_PRIVATE from the file, so restoring costs no copy and writes by the
+// new vm stay private to it.
+class snapshot_image {
+public:
+    explicit snapshot_image(const std::string& path);
+    ~snapshot_image();
+    unsigned nr_vcpus() const { return _vcpu_recs.size(); }
+    // adds the saved slots to map; they live as long as the image
+    void restore_memory(mem_map& map);
+    void restore_vcpu(unsigned index, kvm::vcpu& vcpu);
+    // pages of the restored memory that were written and so are no longer
+    // backed by the file
+    uint64_t private_pages() const;
+    const std::vector<snapshot_slot>& slots() const { return _layout; }
+private:
+    typedef std::tr1::shared_ptr<mem_slot> mem_slot_ptr;
+    struct mapping {
+        void *addr;
+        size_t len;
+    };
+    kvm::fd _fd;
+    std::vector<snapshot_slot> _layout;
+    std::vector<snapshot_vcpu> _vcpu_recs;
+    std::vector<mapping> _mappings;
+    std::vector<mem_slot_ptr> _slots;
+};
+
+#endif
@@ -39,6 +39,13 @@ tests-common = $(TEST_DIR)/vmexit.flat $(TEST_DIR)/tsc.flat \
 ifdef API
 tests-common += api/api-sample
 tests-common += api/dirty-log
+tests-common += api/exit-latency
+tests-common += api/doorbell
+tests-common += api/msr-bench
+tests-common += api/clone-bench
+tests-common += api/hugepage-bench
+tests-common += api/halt-poll
+tests-common += api/kick-bench
 endif
 
 tests_and_config = $(TEST_DIR)/*.flat $(TEST_DIR)/unittests.cfg
@@ -96,9 +103,25 @@ api/%.o: CFLAGS += -m32
 api/%: LDLIBS += -lstdc++ -lboost_thread-mt -lpthread
 api/%: LDFLAGS += -m32
 
-api/libapi.a: api/kvmxx.o api/identity.o api/exception.o api/memmap.o
+api/libapi.a: api/kvmxx.o api/identity.o api/exception.o api/memmap.o \
+	api/snapshot.o api/clone.o api/guestram.o api/executor.o \
+	api/guestmem.o api/kvmstats.o
 	$(AR) rcs $@ $^
 
 api/api-sample: api/api-sample.o api/libapi.a
 
 api/dirty-log: api/dirty-log.o api/libapi.a
+
+api/exit-latency: api/exit-latency.o api/libapi.a
+
+api/doorbell: api/doorbell.o api/libapi.a
+
+api/msr-bench: api/msr-bench.o api/libapi.a
+
+api/clone-bench: api/clone-bench.o api/libapi.a
+
+api/hugepage-bench: api/hugepage-bench.o api/libapi.a
+
+api/halt-poll: api/halt-poll.o api/libapi.a
+
+api/kick-bench: api/kick-bench.o api/libapi.a
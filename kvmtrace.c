@@ -27,12 +27,16 @@
 #include <sys/statfs.h>
 #include <sys/poll.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <getopt.h>
 #include <errno.h>
 #include <sched.h>
+#include <time.h>
 
 #ifndef __user
 #define __user
@@ -50,11 +54,82 @@ static char kvmtrace_version[] = "0.1";
 
 #define OFILE_BUF	(128 * 1024)
 
+/*
+ * Streaming: records are reordered across cpus within this many ms, and
+ * written out in batches of up to STREAM_IOV records
+ */
+#define STREAM_WINDOW	200
+#define STREAM_IOV	256
+
+/*
+ * Flight recorder: event triggered dumps are at least this many seconds
+ * apart
+ */
+#define FLIGHT_HOLDOFF	1
+
+/*
+ * Aggregation: table sizes; whatever doesn't fit is counted as "other"
+ */
+#define AGG_VCPUS	256
+#define AGG_EVENTS	128
+#define AGG_EXITS	1024
+#define AGG_HIST	64
+
+#define TRC_MAGIC	0x12345678
+#define TRC_REC_MAX	(KVM_TRC_HEAD_SIZE + KVM_TRC_CYCLE_SIZE + 7 * 4)
+
+/*
+ * Compressed output: a kz_header, then one kz_block per relay read, then
+ * a kz_index_header, a kz_index entry per block and a kz_trailer.
+ *
+ * In a block each record is the varint of its header words xor'ed with
+ * those of the record before, the zigzag varint of its timestamp minus
+ * the one before, and the varint of each data word. The xor and delta
+ * state starts from zero in every block, so blocks decode on their own.
+ */
+#define KZ_MAGIC	0x4b5a5431	/* "1TZK" */
+#define KZ_BLOCK_MAGIC	0x4b5a4231	/* "1BZK" */
+#define KZ_INDEX_MAGIC	0x4b5a4931	/* "1IZK" */
+#define KZ_VERSION	1
+
+struct kz_header {
+	__u32 magic;
+	__u32 version;
+};
+
+struct kz_block {
+	__u32 magic;
+	__u32 len;		/* encoded bytes following this header */
+	__u32 nr_records;
+	__u32 raw_len;
+	__u64 first_ts;
+	__u64 last_ts;
+};
+
+struct kz_index_header {
+	__u32 magic;
+	__u32 nr_blocks;
+};
+
+struct kz_index {
+	__u64 first_ts;
+	__u64 last_ts;
+	__u64 offset;		/* of the kz_block */
+	__u32 nr_records;
+	__u32 len;
+};
+
+struct kz_trailer {
+	__u64 index_offset;	/* of the kz_index_header */
+	__u32 nr_blocks;
+	__u32 magic;
+};
+
 #define DEBUGFS_TYPE	0x64626720
 
 #define max(a, b)	((a) > (b) ? (a) : (b))
 
-#define S_OPTS	"r:o:w:?Vb:n:D:"
+#define S_OPTS	"r:o:w:?Vb:n:D:sS:W:F:T:zA:"
 static struct option l_opts[] = {
 	{
 		.name = "relay",
@@ -98,11 +173,154 @@ static struct option l_opts[] = {
 		.flag = NULL,
 		.val = 'D'
 	},
+	{
+		.name = "splice",
+		.has_arg = no_argument,
+		.flag = NULL,
+		.val = 's'
+	},
+	{
+		.name = "stream",
+		.has_arg = required_argument,
+		.flag = NULL,
+		.val = 'S'
+	},
+	{
+		.name = "stream-window",
+		.has_arg = required_argument,
+		.flag = NULL,
+		.val = 'W'
+	},
+	{
+		.name = "flight-recorder",
+		.has_arg = required_argument,
+		.flag = NULL,
+		.val = 'F'
+	},
+	{
+		.name = "trigger",
+		.has_arg = required_argument,
+		.flag = NULL,
+		.val = 'T'
+	},
+	{
+		.name = "compress",
+		.has_arg = no_argument,
+		.flag = NULL,
+		.val = 'z'
+	},
+	{
+		.name = "aggregate",
+		.has_arg = required_argument,
+		.flag = NULL,
+		.val = 'A'
+	},
 	{
 		.name = NULL,
 	}
 };
 
+/*
+ * A run of whole trace records read from one cpu
+ */
+struct stream_chunk {
+	struct stream_chunk *next;
+	struct stream_queue *owner;
+	unsigned int len;
+	char data[];
+};
+
+struct stream_queue {
+	/*
+	 * handed between the cpu thread and the merger, or its compression
+	 * thread, under stream_lock
+	 */
+	struct stream_chunk *ready, *ready_tail;
+	struct stream_chunk *free;
+
+	/*
+	 * cpu thread: the partial record at the end of the last read
+	 */
+	char carry[TRC_REC_MAX];
+	unsigned int carry_len;
+	int magic_seen;
+
+	/*
+	 * merger: chunks being merged, and the next record's position
+	 */
+	struct stream_chunk *cur, *cur_tail;
+	unsigned int off;
+	unsigned long long ts;
+	unsigned long long empty_since;
+	int in_heap;
+};
+
+/*
+ * The last records of one cpu, oldest at tail; dumped on a trigger
+ */
+struct flight_ring {
+	char *buf;
+	unsigned long size;
+	unsigned long head, tail, used;
+
+	char *stage;
+	unsigned int carry_len;
+	int magic_seen;
+
+	int dumped_gen;
+	unsigned int dumps;
+};
+
+/*
+ * Per cpu compression thread state
+ */
+struct compress_state {
+	pthread_t thread;
+	int fd;
+	unsigned char *out;
+	unsigned long long offset;
+	unsigned long long bytes;
+	struct kz_index *index;
+	unsigned int nr_blocks;
+	unsigned int index_size;
+	int failed;
+};
+
+/*
+ * Counters decoded from one cpu's records. Only its cpu thread writes
+ * them; the main thread sums all cpus' tables to print them.
+ */
+struct agg_vcpu {
+	__u32 used;
+	__u32 pid;
+	__u32 vcpu;
+	__u32 exit_reason;
+	unsigned long long exit_ts;
+	unsigned long long records;
+	unsigned long long exits;
+};
+
+struct agg_event {
+	__u32 event;
+	unsigned long long count;
+};
+
+struct agg_exit {
+	unsigned long long count;
+	unsigned long long cycles;	/* VMEXIT to the next VMENTRY */
+	unsigned long long timed;	/* exits that cycles covers */
+};
+
+struct agg_table {
+	unsigned long long records;
+	struct agg_vcpu vcpus[AGG_VCPUS];
+	unsigned long long vcpus_other;
+	struct agg_event events[AGG_EVENTS];
+	unsigned long long events_other;
+	struct agg_exit exits[AGG_EXITS + 1];
+	unsigned long long hist[AGG_HIST];	/* log2 of cycles */
+};
+
 struct thread_information {
 	int cpu;
 	pthread_t thread;
@@ -117,6 +335,8 @@ struct thread_information {
 	int (*read_data)(struct thread_information *, void *, unsigned int);
 
 	unsigned long long data_read;
+	unsigned long long data_mmap;
+	unsigned long long data_spliced;
 
 	struct kvm_trace_information *trace_info;
 
@@ -131,6 +351,21 @@ struct thread_information {
 	void *fs_buf;
 	unsigned long fs_buf_len;
 
+	/*
+	 * splice output: relay file -> pipe -> output file
+	 */
+	int pipe_fd[2];
+
+	struct stream_queue stream;
+
+	struct flight_ring flight;
+
+	struct compress_state compress;
+
+	struct agg_table *agg;
+	char *agg_stage;
+	unsigned int agg_carry_len;
+	int agg_magic_seen;
 };
 
 struct kvm_trace_information {
@@ -155,6 +390,16 @@ static int stop_watch;
 static unsigned long buf_size = BUF_SIZE;
 static unsigned long buf_nr = BUF_NR;
 static unsigned int page_size;
+static int use_splice;
+static char *stream_dest;
+static unsigned int stream_window = STREAM_WINDOW;
+static unsigned long flight_size;
+static int flight_trigger;
+static __u32 flight_event;
+static int flight_match_d1;
+static __u32 flight_d1;
+static int compress;
+static int aggregate;
 
 #define for_each_cpu_online(cpu) \
 	for (cpu = 0; cpu < ncpus; cpu++)
@@ -169,12 +414,43 @@ static volatile int trace_stopped;
 
 static void exit_trace(int status);
 
+static int stream_fd = -1;
+static int stream_closed;
+static pthread_mutex_t stream_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t stream_data_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t stream_free_cond = PTHREAD_COND_INITIALIZER;
+
+static struct iovec stream_iov[STREAM_IOV];
+static int stream_iov_nr;
+static struct stream_chunk *stream_retired;
+static struct thread_information **stream_heap;
+static int stream_heap_nr;
+
+static unsigned long long stream_records;
+static unsigned long long stream_late;
+static unsigned long long stream_bytes;
+static unsigned long long stream_last_ts;
+
+static volatile int flight_dump_gen;
+static time_t flight_last_trigger;
+
 static void handle_sigint(__attribute__((__unused__)) int sig)
 {
 	ioctl(trace_information.fd, KVM_TRACE_PAUSE);
 	done = 1;
 }
 
+static void handle_flight_dump(__attribute__((__unused__)) int sig)
+{
+	__sync_fetch_and_add(&flight_dump_gen, 1);
+}
+
+static void handle_flight_alarm(int sig)
+{
+	handle_flight_dump(sig);
+	handle_sigint(sig);
+}
+
 static int get_lost_records()
 {
 	int fd;
@@ -272,29 +548,715 @@ static int mmap_subbuf(struct thread_information *tip, unsigned int maxlen)
 		tip->fs_buf_len = (nr * size) - tip->fs_off;
 		tip->fs_max_size += tip->fs_buf_len;
 
-		if (ftruncate(ofd, tip->fs_max_size) < 0) {
-			perror("ftruncate");
-			return -1;
-		}
+		if (ftruncate(ofd, tip->fs_max_size) < 0) {
+			perror("ftruncate");
+			return -1;
+		}
+
+		tip->fs_buf = mmap(NULL, tip->fs_buf_len, PROT_WRITE,
+				   MAP_SHARED, ofd, tip->fs_size - tip->fs_off);
+		if (tip->fs_buf == MAP_FAILED) {
+			perror("mmap");
+			return -1;
+		}
+		mlock(tip->fs_buf, tip->fs_buf_len);
+	}
+
+	ret = tip->read_data(tip, tip->fs_buf + tip->fs_off, maxlen);
+	if (ret >= 0) {
+		tip->data_read += ret;
+		tip->data_mmap += ret;
+		tip->fs_size += ret;
+		tip->fs_off += ret;
+		return 0;
+	}
+
+	return -1;
+}
+
+/*
+ * Move a sub buffer from the relay file to the output file through a
+ * pipe, without copying it through user space. Returns the bytes moved.
+ */
+static int splice_subbuf(struct thread_information *tip, unsigned int maxlen)
+{
+	int ofd = fileno(tip->ofile);
+	ssize_t ret, out;
+	size_t left;
+
+	do {
+		wait_for_data(tip, 100);
+
+		ret = splice(tip->fd, NULL, tip->pipe_fd[1], NULL, maxlen,
+			     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (ret > 0)
+			break;
+		if (ret < 0 && errno != EAGAIN) {
+			/*
+			 * relay or pipe without splice support, copy instead
+			 */
+			if (errno == EINVAL && !tip->data_spliced) {
+				fprintf(stderr, "Thread %d can't splice %s, "
+					"using mmap output\n", tip->cpu, tip->fn);
+				tip->get_subbuf = mmap_subbuf;
+				tip->fs_max_size = tip->fs_size;
+				return mmap_subbuf(tip, maxlen);
+			}
+			perror("splice");
+			return -1;
+		}
+	} while (!is_done());
+
+	if (ret <= 0)
+		return 0;
+
+	for (left = ret; left; left -= out) {
+		out = splice(tip->pipe_fd[0], NULL, ofd, NULL, left,
+			     SPLICE_F_MOVE);
+		if (out <= 0) {
+			perror("splice");
+			return -1;
+		}
+	}
+
+	tip->data_read += ret;
+	tip->data_spliced += ret;
+	tip->fs_size += ret;
+	return ret;
+}
+
+static unsigned int rec_len(const char *rec)
+{
+	__u32 event;
+
+	memcpy(&event, rec, sizeof(event));
+	return KVM_TRC_HEAD_SIZE + ((event >> 31) ? KVM_TRC_CYCLE_SIZE : 0) +
+		((event >> 28) & 7) * 4;
+}
+
+/*
+ * Strip the magic that starts each cpu's data, and return how many bytes
+ * of buf hold whole records; the rest of *len is a partial record.
+ */
+static unsigned int frame_records(char *buf, unsigned int *len,
+				  int *magic_seen)
+{
+	unsigned int off = 0;
+
+	if (!*magic_seen && *len >= sizeof(__u32)) {
+		*len -= sizeof(__u32);
+		memmove(buf, buf + sizeof(__u32), *len);
+		*magic_seen = 1;
+	}
+
+	while (*magic_seen && off + KVM_TRC_HEAD_SIZE <= *len &&
+	       off + rec_len(buf + off) <= *len)
+		off += rec_len(buf + off);
+
+	return off;
+}
+
+/*
+ * For streaming, hand whole records to the merger in chunks; a record
+ * split by the read is carried over to the next chunk.
+ */
+static int stream_subbuf(struct thread_information *tip, unsigned int maxlen)
+{
+	struct stream_queue *q = &tip->stream;
+	struct stream_chunk *c;
+	unsigned int len, off;
+	int ret;
+
+	pthread_mutex_lock(&stream_lock);
+	while (!q->free && !stream_closed)
+		pthread_cond_wait(&stream_free_cond, &stream_lock);
+	c = q->free;
+	if (c)
+		q->free = c->next;
+	pthread_mutex_unlock(&stream_lock);
+	if (!c)
+		return -1;
+
+	memcpy(c->data, q->carry, q->carry_len);
+	ret = tip->read_data(tip, c->data + q->carry_len, maxlen);
+	if (ret > 0) {
+		tip->data_read += ret;
+		len = q->carry_len + ret;
+		off = frame_records(c->data, &len, &q->magic_seen);
+		q->carry_len = len - off;
+		memcpy(q->carry, c->data + off, q->carry_len);
+		c->len = off;
+	} else
+		c->len = 0;
+
+	pthread_mutex_lock(&stream_lock);
+	if (c->len) {
+		c->next = NULL;
+		if (q->ready_tail)
+			q->ready_tail->next = c;
+		else
+			q->ready = c;
+		q->ready_tail = c;
+		pthread_cond_broadcast(&stream_data_cond);
+	} else {
+		c->next = q->free;
+		q->free = c;
+	}
+	pthread_mutex_unlock(&stream_lock);
+
+	return ret;
+}
+
+static void stream_free_list(struct stream_chunk *c)
+{
+	struct stream_chunk *next;
+
+	for (; c; c = next) {
+		next = c->next;
+		free(c);
+	}
+}
+
+static int tip_open_stream(struct thread_information *tip)
+{
+	struct stream_queue *q = &tip->stream;
+	struct stream_chunk *c;
+	unsigned long i;
+
+	for (i = 0; i < max(2, tip->trace_info->buf_nr); i++) {
+		c = malloc(sizeof(*c) + tip->trace_info->buf_size +
+			   TRC_REC_MAX);
+		if (!c) {
+			fprintf(stderr, "Out of memory, stream buffers\n");
+			return 1;
+		}
+		c->owner = q;
+		c->next = q->free;
+		q->free = c;
+	}
+
+	return 0;
+}
+
+static void ring_put(struct flight_ring *r, const char *data, unsigned int len)
+{
+	unsigned long first;
+	char hdr[sizeof(__u32)];
+	unsigned int n;
+
+	/*
+	 * make room by dropping the oldest whole records
+	 */
+	while (r->size - r->used < len) {
+		first = MIN(sizeof(hdr), r->size - r->tail);
+		memcpy(hdr, r->buf + r->tail, first);
+		memcpy(hdr + first, r->buf, sizeof(hdr) - first);
+		n = rec_len(hdr);
+		r->tail = (r->tail + n) % r->size;
+		r->used -= n;
+	}
+
+	first = MIN(len, r->size - r->head);
+	memcpy(r->buf + r->head, data, first);
+	memcpy(r->buf, data + first, len - first);
+	r->head = (r->head + len) % r->size;
+	r->used += len;
+}
+
+static void flight_match(const char *rec)
+{
+	unsigned int off = KVM_TRC_HEAD_SIZE;
+	__u32 event, d1;
+	time_t now, last;
+
+	memcpy(&event, rec, sizeof(event));
+	if ((event & 0x0fffffff) != flight_event)
+		return;
+
+	if (flight_match_d1) {
+		if (!((event >> 28) & 7))
+			return;
+		if (event >> 31)
+			off += KVM_TRC_CYCLE_SIZE;
+		memcpy(&d1, rec + off, sizeof(d1));
+		if (d1 != flight_d1)
+			return;
+	}
+
+	now = time(NULL);
+	last = flight_last_trigger;
+	if (now - last < FLIGHT_HOLDOFF ||
+	    !__sync_bool_compare_and_swap(&flight_last_trigger, last, now))
+		return;
+
+	__sync_fetch_and_add(&flight_dump_gen, 1);
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+static int fill_ofname(struct thread_information *tip, char *dst);
+
+/*
+ * Write the ring out as <name>.kvmtrace.<cpu>.<dump number>, in the
+ * format of a regular per-cpu output file
+ */
+static void flight_dump(struct thread_information *tip, int gen)
+{
+	struct flight_ring *r = &tip->flight;
+	char op[MAXPATHLEN + 64];
+	__u32 magic = TRC_MAGIC;
+	unsigned long first;
+	int fd, len;
+
+	if (fill_ofname(tip, op))
+		return;
+	len = strlen(op);
+	snprintf(op + len, sizeof(op) - len, ".%d", gen);
+
+	fd = open(op, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror(op);
+		return;
+	}
+
+	first = MIN(r->used, r->size - r->tail);
+	if (write_all(fd, &magic, sizeof(magic)) ||
+	    write_all(fd, r->buf + r->tail, first) ||
+	    write_all(fd, r->buf, r->used - first))
+		perror(op);
+	else
+		r->dumps++;
+	close(fd);
+}
+
+static void flight_check_dump(struct thread_information *tip)
+{
+	int gen = flight_dump_gen;
+
+	if (gen != tip->flight.dumped_gen) {
+		tip->flight.dumped_gen = gen;
+		flight_dump(tip, gen);
+	}
+}
+
+/*
+ * Flight recorder: keep whole records in the ring, and dump it when
+ * asked. Polls with a timeout so that idle cpus notice dumps too.
+ */
+static int flight_subbuf(struct thread_information *tip, unsigned int maxlen)
+{
+	struct flight_ring *r = &tip->flight;
+	struct pollfd pfd = { .fd = tip->fd, .events = POLLIN };
+	unsigned int len, off, n;
+	int ret;
+
+	flight_check_dump(tip);
+
+	if (!is_done() && poll(&pfd, 1, 100) < 0 && errno != EINTR) {
+		perror("poll");
+		return -1;
+	}
+
+	ret = read(tip->fd, r->stage + r->carry_len, maxlen);
+	if (ret < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return 0;
+		perror(tip->fn);
+		fprintf(stderr, "Thread %d failed read of %s\n",
+			tip->cpu, tip->fn);
+		return -1;
+	}
+	if (!ret)
+		return 0;
+
+	tip->data_read += ret;
+	len = r->carry_len + ret;
+	off = frame_records(r->stage, &len, &r->magic_seen);
+	if (flight_trigger)
+		for (n = 0; n < off; n += rec_len(r->stage + n))
+			flight_match(r->stage + n);
+	ring_put(r, r->stage, off);
+
+	r->carry_len = len - off;
+	memmove(r->stage, r->stage + off, r->carry_len);
+	return ret;
+}
+
+static int tip_open_flight(struct thread_information *tip)
+{
+	struct flight_ring *r = &tip->flight;
+
+	r->size = flight_size;
+	r->buf = mmap(NULL, r->size, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (r->buf == MAP_FAILED) {
+		r->buf = NULL;
+		perror("mmap");
+		return 1;
+	}
+	if (mlock(r->buf, r->size) < 0)
+		perror("mlock flight recorder");
+
+	r->stage = malloc(tip->trace_info->buf_size + TRC_REC_MAX);
+	if (!r->stage) {
+		fprintf(stderr, "Out of memory, flight recorder\n");
+		return 1;
+	}
+
+	return 0;
+}
+
+static unsigned char *put_varint(unsigned char *p, unsigned long long v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+/*
+ * Encode one chunk of whole records as a block, and note it in the index
+ */
+static int compress_chunk(struct thread_information *tip,
+			  struct stream_chunk *c)
+{
+	struct compress_state *z = &tip->compress;
+	struct kz_block *blk = (struct kz_block *)z->out;
+	unsigned char *p = z->out + sizeof(*blk);
+	__u32 w[3], prev[3] = { 0, 0, 0 }, d;
+	unsigned long long ts, prev_ts = 0;
+	long long delta;
+	unsigned int off, i, nd;
+	const char *data;
+	struct kz_index *idx;
+
+	memset(blk, 0, sizeof(*blk));
+	blk->magic = KZ_BLOCK_MAGIC;
+	blk->raw_len = c->len;
+
+	for (off = 0; off < c->len; off += rec_len(c->data + off)) {
+		memcpy(w, c->data + off, sizeof(w));
+		for (i = 0; i < 3; i++) {
+			p = put_varint(p, w[i] ^ prev[i]);
+			prev[i] = w[i];
+		}
+
+		data = c->data + off + KVM_TRC_HEAD_SIZE;
+		if (w[0] >> 31) {
+			memcpy(&ts, data, sizeof(ts));
+			data += KVM_TRC_CYCLE_SIZE;
+			delta = ts - prev_ts;
+			p = put_varint(p, (delta << 1) ^ (delta >> 63));
+			if (!prev_ts)
+				blk->first_ts = ts;
+			blk->last_ts = prev_ts = ts;
+		}
+
+		nd = (w[0] >> 28) & 7;
+		for (i = 0; i < nd; i++) {
+			memcpy(&d, data + i * sizeof(d), sizeof(d));
+			p = put_varint(p, d);
+		}
+		blk->nr_records++;
+	}
+	blk->len = p - z->out - sizeof(*blk);
+
+	if (write_all(z->fd, z->out, p - z->out) < 0) {
+		perror("write compressed trace");
+		return -1;
+	}
+
+	if (z->nr_blocks == z->index_size) {
+		z->index_size = max(64, 2 * z->index_size);
+		idx = realloc(z->index, z->index_size * sizeof(*idx));
+		if (!idx) {
+			fprintf(stderr, "Out of memory, block index\n");
+			return -1;
+		}
+		z->index = idx;
+	}
+	idx = &z->index[z->nr_blocks++];
+	idx->first_ts = blk->first_ts;
+	idx->last_ts = blk->last_ts;
+	idx->offset = z->offset;
+	idx->nr_records = blk->nr_records;
+	idx->len = blk->len;
+
+	z->offset += p - z->out;
+	z->bytes += p - z->out;
+	return 0;
+}
+
+static int compress_write_index(struct compress_state *z)
+{
+	struct kz_index_header ih = {
+		.magic = KZ_INDEX_MAGIC,
+		.nr_blocks = z->nr_blocks,
+	};
+	struct kz_trailer tr = {
+		.index_offset = z->offset,
+		.nr_blocks = z->nr_blocks,
+		.magic = KZ_INDEX_MAGIC,
+	};
+
+	if (write_all(z->fd, &ih, sizeof(ih)) < 0 ||
+	    write_all(z->fd, z->index, z->nr_blocks * sizeof(*z->index)) < 0 ||
+	    write_all(z->fd, &tr, sizeof(tr)) < 0) {
+		perror("write block index");
+		return -1;
+	}
+	z->bytes += sizeof(ih) + z->nr_blocks * sizeof(*z->index) + sizeof(tr);
+	return 0;
+}
+
+/*
+ * Takes the chunks the cpu thread reads, so that encoding and disk
+ * writes never hold up the relay reader
+ */
+static void *compress_main(void *arg)
+{
+	struct thread_information *tip = arg;
+	struct stream_queue *q = &tip->stream;
+	struct compress_state *z = &tip->compress;
+	struct stream_chunk *c;
+
+	for (;;) {
+		pthread_mutex_lock(&stream_lock);
+		while (!q->ready && !tip->exited)
+			pthread_cond_wait(&stream_data_cond, &stream_lock);
+		c = q->ready;
+		if (c) {
+			q->ready = c->next;
+			if (!q->ready)
+				q->ready_tail = NULL;
+		}
+		pthread_mutex_unlock(&stream_lock);
+
+		if (!c)
+			break;
+
+		if (!z->failed && compress_chunk(tip, c) < 0) {
+			/*
+			 * keep draining, so the cpu thread isn't stuck
+			 */
+			z->failed = 1;
+			done = 1;
+		}
+
+		pthread_mutex_lock(&stream_lock);
+		c->next = q->free;
+		q->free = c;
+		pthread_cond_broadcast(&stream_free_cond);
+		pthread_mutex_unlock(&stream_lock);
+	}
+
+	if (!z->failed && compress_write_index(z) < 0)
+		z->failed = 1;
+	return NULL;
+}
+
+static int tip_open_compress(struct thread_information *tip)
+{
+	struct compress_state *z = &tip->compress;
+	struct kz_header hdr = { .magic = KZ_MAGIC, .version = KZ_VERSION };
+	char op[MAXPATHLEN + 64];
+
+	if (fill_ofname(tip, op))
+		return 1;
+
+	z->fd = open(op, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (z->fd < 0) {
+		perror(op);
+		return 1;
+	}
+
+	/*
+	 * worst case, every 4 byte word takes a 5 byte varint
+	 */
+	z->out = malloc(sizeof(struct kz_block) +
+			(tip->trace_info->buf_size + TRC_REC_MAX) * 5 / 4 + 8);
+	if (!z->out) {
+		fprintf(stderr, "Out of memory, compression buffer\n");
+		return 1;
+	}
+
+	if (write_all(z->fd, &hdr, sizeof(hdr)) < 0) {
+		perror(op);
+		return 1;
+	}
+	z->offset = z->bytes = sizeof(hdr);
+
+	if (tip_open_stream(tip))
+		return 1;
+
+	if (pthread_create(&z->thread, NULL, compress_main, tip)) {
+		perror("pthread_create");
+		z->thread = 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+static struct agg_vcpu *agg_find_vcpu(struct agg_table *t, __u32 pid,
+				      __u32 vcpu, int insert)
+{
+	unsigned int i, h = (pid * 31 + vcpu) % AGG_VCPUS;
+	struct agg_vcpu *v;
+
+	for (i = 0; i < AGG_VCPUS; i++) {
+		v = &t->vcpus[(h + i) % AGG_VCPUS];
+		if (!__atomic_load_n(&v->used, __ATOMIC_ACQUIRE)) {
+			if (!insert)
+				return NULL;
+			v->pid = pid;
+			v->vcpu = vcpu;
+			__atomic_store_n(&v->used, 1, __ATOMIC_RELEASE);
+			return v;
+		}
+		if (v->pid == pid && v->vcpu == vcpu)
+			return v;
+	}
+
+	return NULL;
+}
+
+static struct agg_event *agg_find_event(struct agg_table *t, __u32 event,
+					int insert)
+{
+	unsigned int i;
+	struct agg_event *e;
+
+	/*
+	 * 0 marks a free slot
+	 */
+	if (!event)
+		return NULL;
+
+	for (i = 0; i < AGG_EVENTS; i++) {
+		e = &t->events[(event + i) % AGG_EVENTS];
+		if (!__atomic_load_n(&e->event, __ATOMIC_ACQUIRE)) {
+			if (!insert)
+				return NULL;
+			__atomic_store_n(&e->event, event, __ATOMIC_RELEASE);
+			return e;
+		}
+		if (e->event == event)
+			return e;
+	}
+
+	return NULL;
+}
+
+/*
+ * The cpu thread is the only writer of its table, but the -A reporter
+ * reads it concurrently, so both sides use atomics; relaxed ones suffice
+ * for counters summed independently
+ */
+#define agg_add(x, n)	__atomic_fetch_add(&(x), (n), __ATOMIC_RELAXED)
+#define agg_read(x)	__atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+static void agg_record(struct agg_table *t, const char *rec)
+{
+	const char *data = rec + KVM_TRC_HEAD_SIZE;
+	unsigned long long ts = 0, cycles;
+	struct agg_event *e;
+	struct agg_vcpu *v;
+	struct agg_exit *x;
+	__u32 w[3], event, d1 = 0;
+	unsigned int bucket;
+
+	memcpy(w, rec, sizeof(w));
+	event = w[0] & 0x0fffffff;
+	if (w[0] >> 31) {
+		memcpy(&ts, data, sizeof(ts));
+		data += KVM_TRC_CYCLE_SIZE;
+	}
+	if ((w[0] >> 28) & 7)
+		memcpy(&d1, data, sizeof(d1));
+
+	agg_add(t->records, 1);
+
+	e = agg_find_event(t, event, 1);
+	if (e)
+		agg_add(e->count, 1);
+	else
+		agg_add(t->events_other, 1);
+
+	v = agg_find_vcpu(t, w[1], w[2], 1);
+	if (!v) {
+		agg_add(t->vcpus_other, 1);
+		return;
+	}
+	agg_add(v->records, 1);
+
+	if (event == KVM_TRC_VMEXIT) {
+		agg_add(v->exits, 1);
+		v->exit_reason = MIN(d1, AGG_EXITS);
+		v->exit_ts = ts;
+		agg_add(t->exits[v->exit_reason].count, 1);
+	} else if (event == KVM_TRC_VMENTRY && v->exit_ts && ts) {
+		cycles = ts - v->exit_ts;
+		x = &t->exits[v->exit_reason];
+		agg_add(x->cycles, cycles);
+		agg_add(x->timed, 1);
+		bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+		agg_add(t->hist[bucket], 1);
+		v->exit_ts = 0;
+	}
+}
+
+/*
+ * Aggregation: decode the records in place and only count them
+ */
+static int agg_subbuf(struct thread_information *tip, unsigned int maxlen)
+{
+	unsigned int len, off, n;
+	int ret;
+
+	ret = tip->read_data(tip, tip->agg_stage + tip->agg_carry_len, maxlen);
+	if (ret <= 0)
+		return ret;
 
-		tip->fs_buf = mmap(NULL, tip->fs_buf_len, PROT_WRITE,
-				   MAP_SHARED, ofd, tip->fs_size - tip->fs_off);
-		if (tip->fs_buf == MAP_FAILED) {
-			perror("mmap");
-			return -1;
-		}
-		mlock(tip->fs_buf, tip->fs_buf_len);
-	}
+	tip->data_read += ret;
+	len = tip->agg_carry_len + ret;
+	off = frame_records(tip->agg_stage, &len, &tip->agg_magic_seen);
+	for (n = 0; n < off; n += rec_len(tip->agg_stage + n))
+		agg_record(tip->agg, tip->agg_stage + n);
 
-	ret = tip->read_data(tip, tip->fs_buf + tip->fs_off, maxlen);
-	if (ret >= 0) {
-		tip->data_read += ret;
-		tip->fs_size += ret;
-		tip->fs_off += ret;
-		return 0;
+	tip->agg_carry_len = len - off;
+	memmove(tip->agg_stage, tip->agg_stage + off, tip->agg_carry_len);
+	return ret;
+}
+
+static int tip_open_agg(struct thread_information *tip)
+{
+	tip->agg = calloc(1, sizeof(*tip->agg));
+	tip->agg_stage = malloc(tip->trace_info->buf_size + TRC_REC_MAX);
+	if (!tip->agg || !tip->agg_stage) {
+		fprintf(stderr, "Out of memory, aggregation tables\n");
+		return 1;
 	}
 
-	return -1;
+	return 0;
 }
 
 static void tip_ftrunc_final(struct thread_information *tip)
@@ -347,8 +1309,17 @@ static void *thread_main(void *arg)
 	while (tip->get_subbuf(tip, tip->trace_info->buf_size) > 0)
 		;
 
+	if (flight_size)
+		flight_check_dump(tip);
+
 	tip_ftrunc_final(tip);
 	tip->exited = 1;
+
+	if (compress) {
+		pthread_mutex_lock(&stream_lock);
+		pthread_cond_broadcast(&stream_data_cond);
+		pthread_mutex_unlock(&stream_lock);
+	}
 	return NULL;
 }
 
@@ -381,22 +1352,90 @@ static int fill_ofname(struct thread_information *tip, char *dst)
 
 static void fill_ops(struct thread_information *tip)
 {
-	tip->get_subbuf = mmap_subbuf;
+	if (stream_dest || compress)
+		tip->get_subbuf = stream_subbuf;
+	else if (aggregate)
+		tip->get_subbuf = agg_subbuf;
+	else if (flight_size)
+		tip->get_subbuf = flight_subbuf;
+	else if (use_splice)
+		tip->get_subbuf = splice_subbuf;
+	else
+		tip->get_subbuf = mmap_subbuf;
 	tip->read_data = read_data;
 }
 
+static int tip_open_pipe(struct thread_information *tip)
+{
+	if (pipe(tip->pipe_fd) < 0) {
+		perror("pipe");
+		return 1;
+	}
+
+#ifdef F_SETPIPE_SZ
+	/*
+	 * best effort: a pipe as large as a sub buffer moves it in one go
+	 */
+	fcntl(tip->pipe_fd[1], F_SETPIPE_SZ, tip->trace_info->buf_size);
+#endif
+	return 0;
+}
+
 static void close_thread(struct thread_information *tip)
 {
+	unsigned long long compressed;
+	unsigned int dumps, blocks;
+
 	if (tip->fd != -1)
 		close(tip->fd);
 	if (tip->ofile)
 		fclose(tip->ofile);
 	if (tip->ofile_buffer)
 		free(tip->ofile_buffer);
+	if (tip->pipe_fd[0] != -1) {
+		close(tip->pipe_fd[0]);
+		close(tip->pipe_fd[1]);
+	}
 
 	tip->fd = -1;
+	tip->pipe_fd[0] = tip->pipe_fd[1] = -1;
 	tip->ofile = NULL;
 	tip->ofile_buffer = NULL;
+
+	stream_free_list(tip->stream.free);
+	stream_free_list(tip->stream.ready);
+	stream_free_list(tip->stream.cur);
+	memset(&tip->stream, 0, sizeof(tip->stream));
+
+	/*
+	 * the totals are kept for the final report
+	 */
+	if (tip->compress.fd != -1)
+		close(tip->compress.fd);
+	free(tip->compress.out);
+	free(tip->compress.index);
+	compressed = tip->compress.bytes;
+	blocks = tip->compress.nr_blocks;
+	memset(&tip->compress, 0, sizeof(tip->compress));
+	tip->compress.fd = -1;
+	tip->compress.bytes = compressed;
+	tip->compress.nr_blocks = blocks;
+
+	/*
+	 * so are the tables
+	 */
+	free(tip->agg_stage);
+	tip->agg_stage = NULL;
+
+	/*
+	 * and the dump count
+	 */
+	if (tip->flight.buf)
+		munmap(tip->flight.buf, tip->flight.size);
+	free(tip->flight.stage);
+	dumps = tip->flight.dumps;
+	memset(&tip->flight, 0, sizeof(tip->flight));
+	tip->flight.dumps = dumps;
 }
 
 static int tip_open_output(struct thread_information *tip)
@@ -404,6 +1443,42 @@ static int tip_open_output(struct thread_information *tip)
 	int mode, vbuf_size;
 	char op[NAME_MAX];
 
+	if (stream_dest) {
+		if (tip_open_stream(tip)) {
+			close_thread(tip);
+			return 1;
+		}
+		fill_ops(tip);
+		return 0;
+	}
+
+	if (aggregate) {
+		if (tip_open_agg(tip)) {
+			close_thread(tip);
+			return 1;
+		}
+		fill_ops(tip);
+		return 0;
+	}
+
+	if (compress) {
+		if (tip_open_compress(tip)) {
+			close_thread(tip);
+			return 1;
+		}
+		fill_ops(tip);
+		return 0;
+	}
+
+	if (flight_size) {
+		if (tip_open_flight(tip)) {
+			close_thread(tip);
+			return 1;
+		}
+		fill_ops(tip);
+		return 0;
+	}
+
 	if (fill_ofname(tip, op))
 		return 1;
 
@@ -423,6 +1498,11 @@ static int tip_open_output(struct thread_information *tip)
 		return 1;
 	}
 
+	if (use_splice && tip_open_pipe(tip)) {
+		close_thread(tip);
+		return 1;
+	}
+
 	fill_ops(tip);
 	return 0;
 }
@@ -435,6 +1515,8 @@ static int start_threads(int cpu)
 	tip->cpu = cpu;
 	tip->trace_info = &trace_information;
 	tip->fd = -1;
+	tip->pipe_fd[0] = tip->pipe_fd[1] = -1;
+	tip->compress.fd = -1;
 
 	if (tip_open_output(tip))
 	    return 1;
@@ -457,6 +1539,9 @@ static void stop_threads()
 	for_each_tip(tip, i) {
 		if (tip->thread)
 			(void) pthread_join(tip->thread, (void *) &ret);
+		if (tip->compress.thread)
+			(void) pthread_join(tip->compress.thread,
+					    (void *) &ret);
 		close_thread(tip);
 	}
 }
@@ -551,6 +1636,481 @@ static int start_kvm_trace(void)
 	return 0;
 }
 
+static int stream_open(void)
+{
+	struct sockaddr_un addr;
+
+	if (!strcmp(stream_dest, "-")) {
+		stream_fd = STDOUT_FILENO;
+		return 0;
+	}
+
+	if (strlen(stream_dest) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path too long: %s\n", stream_dest);
+		return 1;
+	}
+
+	stream_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (stream_fd < 0) {
+		perror("socket");
+		return 1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, stream_dest);
+	if (connect(stream_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror(stream_dest);
+		close(stream_fd);
+		stream_fd = -1;
+		return 1;
+	}
+
+	return 0;
+}
+
+static unsigned long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Timestamp of the queue's next record; records without one sort with
+ * the record before them.
+ */
+static unsigned long long stream_next_ts(struct stream_queue *q)
+{
+	char *rec = q->cur->data + q->off;
+	__u32 event;
+
+	memcpy(&event, rec, sizeof(event));
+	if (event >> 31)
+		memcpy(&q->ts, rec + KVM_TRC_HEAD_SIZE, sizeof(q->ts));
+	return q->ts;
+}
+
+static void stream_heap_push(struct thread_information *tip)
+{
+	int i = stream_heap_nr++, parent;
+
+	while (i) {
+		parent = (i - 1) / 2;
+		if (stream_heap[parent]->stream.ts <= tip->stream.ts)
+			break;
+		stream_heap[i] = stream_heap[parent];
+		i = parent;
+	}
+	stream_heap[i] = tip;
+	tip->stream.in_heap = 1;
+}
+
+static struct thread_information *stream_heap_pop(void)
+{
+	struct thread_information *top = stream_heap[0];
+	struct thread_information *last = stream_heap[--stream_heap_nr];
+	int i = 0, child;
+
+	while ((child = 2 * i + 1) < stream_heap_nr) {
+		if (child + 1 < stream_heap_nr &&
+		    stream_heap[child + 1]->stream.ts <
+		    stream_heap[child]->stream.ts)
+			child++;
+		if (last->stream.ts <= stream_heap[child]->stream.ts)
+			break;
+		stream_heap[i] = stream_heap[child];
+		i = child;
+	}
+	stream_heap[i] = last;
+	top->stream.in_heap = 0;
+	return top;
+}
+
+static void stream_add(void *buf, size_t len)
+{
+	struct iovec *prev;
+
+	/*
+	 * consecutive records from one chunk go out as one iovec
+	 */
+	if (stream_iov_nr) {
+		prev = &stream_iov[stream_iov_nr - 1];
+		if (prev->iov_base + prev->iov_len == buf) {
+			prev->iov_len += len;
+			return;
+		}
+	}
+	stream_iov[stream_iov_nr].iov_base = buf;
+	stream_iov[stream_iov_nr].iov_len = len;
+	stream_iov_nr++;
+}
+
+/*
+ * Write out the batched records, then give the chunks they came from
+ * back to their cpu threads
+ */
+static int stream_flush(void)
+{
+	struct iovec *iov = stream_iov;
+	int nr = stream_iov_nr;
+	struct stream_chunk *c;
+	ssize_t ret;
+
+	while (nr) {
+		ret = writev(stream_fd, iov, nr);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("writev");
+			return -1;
+		}
+		stream_bytes += ret;
+		while (nr && (size_t)ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			nr--;
+		}
+		if (nr) {
+			iov->iov_base += ret;
+			iov->iov_len -= ret;
+		}
+	}
+	stream_iov_nr = 0;
+
+	if (stream_retired) {
+		pthread_mutex_lock(&stream_lock);
+		while ((c = stream_retired)) {
+			stream_retired = c->next;
+			c->next = c->owner->free;
+			c->owner->free = c;
+		}
+		pthread_cond_broadcast(&stream_free_cond);
+		pthread_mutex_unlock(&stream_lock);
+	}
+
+	return 0;
+}
+
+static void stream_wait(unsigned long long ms)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	pthread_mutex_lock(&stream_lock);
+	pthread_cond_timedwait(&stream_data_cond, &stream_lock, &ts);
+	pthread_mutex_unlock(&stream_lock);
+}
+
+/*
+ * Merge the per-cpu streams in timestamp order. A record is only written
+ * once every cpu either has a record queued or has been idle for the
+ * whole window, so memory stays bounded by the per-cpu chunks.
+ */
+static int stream_merge(void)
+{
+	static __u32 magic = TRC_MAGIC;
+	struct thread_information *tip;
+	struct stream_queue *q;
+	struct stream_chunk *c;
+	unsigned long long now, wait;
+	int i, waiting, exited, len;
+
+	stream_heap = calloc(ncpus, sizeof(*stream_heap));
+	if (!stream_heap) {
+		fprintf(stderr, "Out of memory, stream heap\n");
+		return -1;
+	}
+	stream_add(&magic, sizeof(magic));
+
+	for (;;) {
+		exited = 1;
+		pthread_mutex_lock(&stream_lock);
+		for_each_tip(tip, i) {
+			q = &tip->stream;
+			exited &= tip->exited;
+			if (!q->ready)
+				continue;
+			if (q->cur_tail)
+				q->cur_tail->next = q->ready;
+			else
+				q->cur = q->ready;
+			q->cur_tail = q->ready_tail;
+			q->ready = q->ready_tail = NULL;
+		}
+		pthread_mutex_unlock(&stream_lock);
+
+		now = now_ms();
+		wait = stream_window;
+		waiting = 0;
+		for_each_tip(tip, i) {
+			q = &tip->stream;
+			if (q->cur) {
+				q->empty_since = 0;
+				if (!q->in_heap) {
+					stream_next_ts(q);
+					stream_heap_push(tip);
+				}
+			} else if (!tip->exited) {
+				if (!q->empty_since)
+					q->empty_since = now;
+				if (now - q->empty_since < stream_window) {
+					waiting = 1;
+					wait = MIN(wait, stream_window -
+						   (now - q->empty_since));
+				}
+			}
+		}
+
+		if (waiting || !stream_heap_nr) {
+			if (!stream_heap_nr && exited)
+				break;
+			if (stream_flush())
+				goto failed;
+			stream_wait(wait);
+			continue;
+		}
+
+		/*
+		 * merge until a cpu runs out of records
+		 */
+		for (;;) {
+			tip = stream_heap_pop();
+			q = &tip->stream;
+			len = rec_len(q->cur->data + q->off);
+			stream_add(q->cur->data + q->off, len);
+			stream_records++;
+			if (q->ts < stream_last_ts)
+				stream_late++;
+			else
+				stream_last_ts = q->ts;
+
+			q->off += len;
+			if (q->off == q->cur->len) {
+				c = q->cur;
+				q->cur = c->next;
+				q->off = 0;
+				c->next = stream_retired;
+				stream_retired = c;
+			}
+			if (stream_iov_nr == STREAM_IOV && stream_flush())
+				goto failed;
+			if (!q->cur) {
+				q->cur_tail = NULL;
+				break;
+			}
+			stream_next_ts(q);
+			stream_heap_push(tip);
+		}
+	}
+
+	if (stream_flush())
+		goto failed;
+	return 0;
+
+failed:
+	/*
+	 * the reader went away; stop tracing and release the cpu threads
+	 */
+	ioctl(trace_information.fd, KVM_TRACE_PAUSE);
+	done = 1;
+	pthread_mutex_lock(&stream_lock);
+	stream_closed = 1;
+	pthread_cond_broadcast(&stream_free_cond);
+	pthread_mutex_unlock(&stream_lock);
+	return -1;
+}
+
+static const struct {
+	__u32 event;
+	const char *name;
+} agg_event_names[] = {
+	{ KVM_TRC_VMENTRY, "VMENTRY" },
+	{ KVM_TRC_VMEXIT, "VMEXIT" },
+	{ KVM_TRC_PAGE_FAULT, "PAGE_FAULT" },
+	{ KVM_TRC_INJ_VIRQ, "INJ_VIRQ" },
+	{ KVM_TRC_REDELIVER_EVT, "REDELIVER_EVT" },
+	{ KVM_TRC_PEND_INTR, "PEND_INTR" },
+	{ KVM_TRC_IO_READ, "IO_READ" },
+	{ KVM_TRC_IO_WRITE, "IO_WRITE" },
+	{ KVM_TRC_CR_READ, "CR_READ" },
+	{ KVM_TRC_CR_WRITE, "CR_WRITE" },
+	{ KVM_TRC_DR_READ, "DR_READ" },
+	{ KVM_TRC_DR_WRITE, "DR_WRITE" },
+	{ KVM_TRC_MSR_READ, "MSR_READ" },
+	{ KVM_TRC_MSR_WRITE, "MSR_WRITE" },
+	{ KVM_TRC_CPUID, "CPUID" },
+	{ KVM_TRC_INTR, "INTR" },
+	{ KVM_TRC_NMI, "NMI" },
+	{ KVM_TRC_VMMCALL, "VMMCALL" },
+	{ KVM_TRC_HLT, "HLT" },
+	{ KVM_TRC_CLTS, "CLTS" },
+	{ KVM_TRC_LMSW, "LMSW" },
+	{ KVM_TRC_APIC_ACCESS, "APIC_ACCESS" },
+	{ KVM_TRC_TDP_FAULT, "TDP_FAULT" },
+	{ KVM_TRC_GTLB_WRITE, "GTLB_WRITE" },
+	{ KVM_TRC_STLB_WRITE, "STLB_WRITE" },
+	{ KVM_TRC_STLB_INVAL, "STLB_INVAL" },
+	{ KVM_TRC_PPC_INSTR, "PPC_INSTR" },
+};
+
+static const char *agg_event_name(__u32 event)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(agg_event_names) / sizeof(agg_event_names[0]);
+	     i++)
+		if (agg_event_names[i].event == event)
+			return agg_event_names[i].name;
+	return "?";
+}
+
+/*
+ * Sum every cpu's table into one; the cpu threads keep counting meanwhile
+ */
+static void agg_merge(struct agg_table *sum)
+{
+	struct thread_information *tip;
+	struct agg_table *t;
+	struct agg_vcpu *v, *sv;
+	struct agg_event *e, *se;
+	int i, j;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_tip(tip, i) {
+		t = tip->agg;
+		if (!t)
+			continue;
+
+		sum->records += agg_read(t->records);
+		sum->vcpus_other += agg_read(t->vcpus_other);
+		sum->events_other += agg_read(t->events_other);
+
+		for (j = 0; j < AGG_VCPUS; j++) {
+			v = &t->vcpus[j];
+			if (!__atomic_load_n(&v->used, __ATOMIC_ACQUIRE))
+				continue;
+			sv = agg_find_vcpu(sum, v->pid, v->vcpu, 1);
+			if (!sv) {
+				sum->vcpus_other += agg_read(v->records);
+				continue;
+			}
+			sv->records += agg_read(v->records);
+			sv->exits += agg_read(v->exits);
+		}
+
+		for (j = 0; j < AGG_EVENTS; j++) {
+			e = &t->events[j];
+			if (!__atomic_load_n(&e->event, __ATOMIC_ACQUIRE))
+				continue;
+			se = agg_find_event(sum, e->event, 1);
+			if (se)
+				se->count += agg_read(e->count);
+			else
+				sum->events_other += agg_read(e->count);
+		}
+
+		for (j = 0; j <= AGG_EXITS; j++) {
+			sum->exits[j].count += agg_read(t->exits[j].count);
+			sum->exits[j].cycles += agg_read(t->exits[j].cycles);
+			sum->exits[j].timed += agg_read(t->exits[j].timed);
+		}
+
+		for (j = 0; j < AGG_HIST; j++)
+			sum->hist[j] += agg_read(t->hist[j]);
+	}
+}
+
+static void agg_print(struct agg_table *t, double secs, double rate)
+{
+	struct agg_exit *x;
+	unsigned long long timed = 0;
+	int i;
+
+	printf("=== %.0f s: %llu records, %.0f/s\n", secs, t->records, rate);
+
+	printf("  %10s %6s %12s %12s\n", "pid", "vcpu", "records", "exits");
+	for (i = 0; i < AGG_VCPUS; i++)
+		if (t->vcpus[i].used)
+			printf("  %10u %6u %12llu %12llu\n", t->vcpus[i].pid,
+			       t->vcpus[i].vcpu, t->vcpus[i].records,
+			       t->vcpus[i].exits);
+	if (t->vcpus_other)
+		printf("  %17s %12llu\n", "other", t->vcpus_other);
+
+	printf("  %10s %-14s %12s\n", "event", "", "count");
+	for (i = 0; i < AGG_EVENTS; i++)
+		if (t->events[i].event)
+			printf("  0x%08x %-14s %12llu\n", t->events[i].event,
+			       agg_event_name(t->events[i].event),
+			       t->events[i].count);
+	if (t->events_other)
+		printf("  %-25s %12llu\n", "other", t->events_other);
+
+	printf("  %10s %12s %16s\n", "exit code", "count",
+	       "cycles to entry");
+	for (i = 0; i <= AGG_EXITS; i++) {
+		x = &t->exits[i];
+		if (!x->count)
+			continue;
+		if (i < AGG_EXITS)
+			printf("  %10d", i);
+		else
+			printf("  %10s", "other");
+		printf(" %12llu %16.0f\n", x->count,
+		       x->timed ? (double)x->cycles / x->timed : 0.0);
+		timed += x->timed;
+	}
+
+	if (!timed)
+		return;
+	printf("  VMEXIT -> VMENTRY cycles\n");
+	for (i = 0; i < AGG_HIST; i++)
+		if (t->hist[i])
+			printf("  %20llu+ %12llu %5.1f%%\n", 1ULL << i,
+			       t->hist[i], 100.0 * t->hist[i] / timed);
+}
+
+/*
+ * Print the merged tables every <aggregate> seconds until the trace ends
+ */
+static void aggregate_threads(void)
+{
+	static struct agg_table sum;
+	unsigned long long start = now_ms(), last = start, now;
+	unsigned long long last_records = 0;
+	struct thread_information *tip;
+	int i, tips_running;
+
+	do {
+		tips_running = 0;
+		usleep(100000);
+
+		for_each_tip(tip, i)
+			tips_running += !tip->exited;
+
+		now = now_ms();
+		if (tips_running && now - last < aggregate * 1000ULL)
+			continue;
+
+		agg_merge(&sum);
+		agg_print(&sum, (now - start) / 1000.0,
+			  now > last ? (sum.records - last_records) * 1000.0 /
+			  (now - last) : 0.0);
+		fflush(stdout);
+		last = now;
+		last_records = sum.records;
+	} while (tips_running);
+}
+
 static void wait_for_threads(void)
 {
 	struct thread_information *tip;
@@ -570,18 +2130,43 @@ static void show_stats(void)
 {
 	struct thread_information *tip;
 	unsigned long long data_read;
+	FILE *out = stream_fd == STDOUT_FILENO ? stderr : stdout;
 	int i;
 
 	data_read = 0;
 	for_each_tip(tip, i) {
-		printf("  CPU%3d: %8llu KiB data\n",
-			tip->cpu, (tip->data_read + 1023) >> 10);
+		fprintf(out, "  CPU%3d: %8llu KiB data "
+			"(mmap %llu KiB, splice %llu KiB)\n",
+			tip->cpu, (tip->data_read + 1023) >> 10,
+			(tip->data_mmap + 1023) >> 10,
+			(tip->data_spliced + 1023) >> 10);
 		data_read += tip->data_read;
 	}
 
-	printf("  Total:  lost %lu, %8llu KiB data\n",
+	fprintf(out, "  Total:  lost %lu, %8llu KiB data\n",
 		trace_information.lost_records, (data_read + 1023) >> 10);
 
+	if (stream_dest)
+		fprintf(out, "  Stream: %llu records, %llu KiB, %llu out of "
+			"order beyond the window\n", stream_records,
+			(stream_bytes + 1023) >> 10, stream_late);
+
+	if (flight_size) {
+		for_each_tip(tip, i)
+			fprintf(out, "  CPU%3d: %u flight recorder dumps\n",
+				tip->cpu, tip->flight.dumps);
+	}
+
+	if (compress) {
+		for_each_tip(tip, i)
+			fprintf(out, "  CPU%3d: %8llu KiB compressed "
+				"(%.1f%%), %u blocks\n", tip->cpu,
+				(tip->compress.bytes + 1023) >> 10,
+				tip->data_read ? 100.0 * tip->compress.bytes /
+				tip->data_read : 0.0,
+				tip->compress.nr_blocks);
+	}
+
 	if (trace_information.lost_records)
 		fprintf(stderr, "You have lost records, "
 				"consider using a larger buffer size (-b)\n");
@@ -589,13 +2174,29 @@ static void show_stats(void)
 
 static char usage_str[] = \
 	"[ -r debugfs path ] [ -D output dir ] [ -b buffer size ]\n" \
-	"[ -n number of buffers] [ -o <output file> ] [ -w time  ] [ -V ]\n\n" \
+	"[ -n number of buffers] [ -o <output file> ] [ -w time  ] [ -s ]\n" \
+	"[ -S <stream destination> ] [ -W window ] [ -F size ]\n" \
+	"[ -T event[:data] ] [ -z ] [ -A interval ] [ -V ]\n\n" \
 	"\t-r Path to mounted debugfs, defaults to /sys/kernel/debug\n" \
 	"\t-o File(s) to send output to\n" \
 	"\t-D Directory to prepend to output file names\n" \
 	"\t-w Stop after defined time, in seconds\n" \
 	"\t-b Sub buffer size in KiB\n" \
 	"\t-n Number of sub buffers\n" \
+	"\t-s Splice relay data to the output files instead of copying it\n" \
+	"\t-S Merge all cpus in timestamp order and stream the records to\n" \
+	"\t   stdout (-) or to the unix socket at this path, instead of\n" \
+	"\t   writing output files\n" \
+	"\t-W Streaming reorder window in ms, defaults to 200\n" \
+	"\t-F Keep the last <size> MiB per cpu in memory, and write it to\n" \
+	"\t   <output file>.<dump number> only on SIGUSR1, at the end of the\n" \
+	"\t   stopwatch, or on the -T event\n" \
+	"\t-T Dump the flight recorder on this event id, optionally only\n" \
+	"\t   if its first data word matches (e.g. an exit reason)\n" \
+	"\t-z Write delta and varint encoded blocks with a time index\n" \
+	"\t-A Write no records, only count them per vcpu, event and exit\n" \
+	"\t   code, and print the counts and exit latencies every\n" \
+	"\t   <interval> seconds\n" \
 	"\t-V Print program version info\n\n";
 
 static void show_usage(char *prog)
@@ -606,6 +2207,7 @@ static void show_usage(char *prog)
 
 void parse_args(int argc, char **argv)
 {
+	char *end;
 	int c;
 
 	while ((c = getopt_long(argc, argv, S_OPTS, l_opts, NULL)) >= 0) {
@@ -649,18 +2251,78 @@ void parse_args(int argc, char **argv)
 		case 'D':
 			output_dir = optarg;
 			break;
+		case 's':
+			use_splice = 1;
+			break;
+		case 'S':
+			stream_dest = optarg;
+			break;
+		case 'W':
+			stream_window = strtoul(optarg, NULL, 10);
+			break;
+		case 'F':
+			flight_size = strtoul(optarg, NULL, 10) << 20;
+			if (!flight_size) {
+				fprintf(stderr,
+					"Invalid flight recorder size (%s)\n",
+					optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'T':
+			flight_event = strtoul(optarg, &end, 0);
+			if (*end == ':') {
+				flight_match_d1 = 1;
+				flight_d1 = strtoul(end + 1, &end, 0);
+			}
+			if (*end) {
+				fprintf(stderr, "Invalid trigger (%s)\n",
+					optarg);
+				exit(EXIT_FAILURE);
+			}
+			flight_trigger = 1;
+			break;
+		case 'z':
+			compress = 1;
+			break;
+		case 'A':
+			aggregate = atoi(optarg);
+			if (aggregate <= 0) {
+				fprintf(stderr,
+					"Invalid aggregation interval (%d secs)\n",
+					aggregate);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		default:
 			show_usage(argv[0]);
 		}
 	}
 
-	if (optind < argc || output_name == NULL)
+	if (optind < argc ||
+	    (output_name == NULL && stream_dest == NULL && !aggregate))
 		show_usage(argv[0]);
+
+	if ((flight_size != 0) + (stream_dest != NULL) + compress +
+	    (aggregate != 0) > 1) {
+		fprintf(stderr, "-F, -S, -z and -A can't be combined\n");
+		exit(EXIT_FAILURE);
+	}
+	if (flight_trigger && !flight_size) {
+		fprintf(stderr, "-T needs a flight recorder (-F)\n");
+		exit(EXIT_FAILURE);
+	}
+	if (flight_size && flight_size < 2 * buf_size) {
+		fprintf(stderr, "Flight recorder must hold at least two "
+			"sub buffers\n");
+		exit(EXIT_FAILURE);
+	}
 }
 
 int main(int argc, char *argv[])
 {
 	struct statfs st;
+	int ret = 0;
 
 	parse_args(argc, argv);
 
@@ -690,18 +2352,28 @@ int main(int argc, char *argv[])
 	signal(SIGINT, handle_sigint);
 	signal(SIGHUP, handle_sigint);
 	signal(SIGTERM, handle_sigint);
-	signal(SIGALRM, handle_sigint);
+	signal(SIGALRM, flight_size ? handle_flight_alarm : handle_sigint);
+	if (flight_size)
+		signal(SIGUSR1, handle_flight_dump);
 	signal(SIGPIPE, SIG_IGN);
 
+	if (stream_dest && stream_open())
+		return 1;
+
 	if (start_kvm_trace() != 0)
 		return 1;
 
 	if (stop_watch)
 		alarm(stop_watch);
 
-	wait_for_threads();
+	if (stream_dest)
+		ret = stream_merge();
+	else if (aggregate)
+		aggregate_threads();
+	else
+		wait_for_threads();
 	stop_all_traces();
 	show_stats();
 
-	return 0;
+	return ret ? 1 : 0;
 }